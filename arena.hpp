@@ -0,0 +1,267 @@
+#ifndef COCAINE_GRAPE_ARENA
+#define COCAINE_GRAPE_ARENA
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+#include <boost/utility.hpp>
+
+// Monotonic allocator: memory is carved from a list of blocks by bumping an
+// offset and is only given back all at once by reset(), which keeps the
+// blocks for the next user. Not thread-safe.
+class arena_t :
+    public boost::noncopyable
+{
+public:
+    arena_t(size_t block_size = 4096) :
+        m_block_size(block_size),
+        m_current(0),
+        m_offset(0)
+    {
+        // pass
+    }
+
+    ~arena_t() {
+        for (auto it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+            ::operator delete(it->first);
+        }
+    }
+
+    void*
+    allocate(size_t size,
+             size_t alignment = 2 * sizeof(void*))
+    {
+        while (m_current < m_blocks.size()) {
+            const size_t offset = (m_offset + alignment - 1) & ~(alignment - 1);
+
+            if (offset + size <= m_blocks[m_current].second) {
+                m_offset = offset + size;
+                return m_blocks[m_current].first + offset;
+            }
+
+            ++m_current;
+            m_offset = 0;
+        }
+
+        const size_t capacity = std::max(m_block_size, size + alignment);
+
+        m_blocks.push_back(std::make_pair(static_cast<char*>(::operator new(capacity)), capacity));
+
+        m_current = m_blocks.size() - 1;
+        m_offset = 0;
+
+        return allocate(size, alignment);
+    }
+
+    void
+    reset() {
+        // Oversized blocks are one-offs, don't let them pin memory.
+        for (size_t i = 0; i < m_blocks.size();) {
+            if (m_blocks[i].second > m_block_size) {
+                ::operator delete(m_blocks[i].first);
+                m_blocks.erase(m_blocks.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+
+        m_current = 0;
+        m_offset = 0;
+    }
+
+private:
+    const size_t m_block_size;
+
+    std::vector<std::pair<char*, size_t>> m_blocks;
+    size_t m_current;
+    size_t m_offset;
+};
+
+// Standard allocator on top of an arena, deallocation is a no-op. Without an
+// arena it falls back to the global heap.
+template<class T>
+struct arena_allocator_t {
+    typedef T value_type;
+
+    arena_allocator_t(std::shared_ptr<arena_t> arena = std::shared_ptr<arena_t>()) :
+        m_arena(arena)
+    {
+        // pass
+    }
+
+    template<class U>
+    arena_allocator_t(const arena_allocator_t<U>& other) :
+        m_arena(other.m_arena)
+    {
+        // pass
+    }
+
+    T*
+    allocate(size_t n) {
+        if (m_arena) {
+            return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+        } else {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+    }
+
+    void
+    deallocate(T *p,
+               size_t /* n */)
+    {
+        if (!m_arena) {
+            ::operator delete(p);
+        }
+    }
+
+    template<class U>
+    bool
+    operator==(const arena_allocator_t<U>& other) const {
+        return m_arena == other.m_arena;
+    }
+
+    template<class U>
+    bool
+    operator!=(const arena_allocator_t<U>& other) const {
+        return m_arena != other.m_arena;
+    }
+
+    std::shared_ptr<arena_t> m_arena;
+};
+
+// Recycles arenas between sessions. An arena is handed out as a shared_ptr
+// whose control block lives in the arena itself, and it returns to the pool
+// when that control block is deallocated, i.e. after the last reference,
+// weak ones included, is gone. So a warmed up pool hands out arenas without
+// touching malloc. acquire() is meant to be called from a single thread,
+// arenas can be released from any. The pool must outlive all the arenas it
+// has handed out.
+class arena_pool_t :
+    public boost::noncopyable
+{
+    template<class T>
+    struct block_allocator_t {
+        typedef T value_type;
+
+        block_allocator_t(arena_t *arena,
+                          arena_pool_t *pool) :
+            m_arena(arena),
+            m_pool(pool)
+        {
+            // pass
+        }
+
+        template<class U>
+        block_allocator_t(const block_allocator_t<U>& other) :
+            m_arena(other.m_arena),
+            m_pool(other.m_pool)
+        {
+            // pass
+        }
+
+        T*
+        allocate(size_t n) {
+            return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+        }
+
+        void
+        deallocate(T * /* p */,
+                   size_t /* n */)
+        {
+            // NOTE: This is the last touch of the control block, so the arena
+            // holding it can be reset and reused from now on.
+            m_pool->release(m_arena);
+        }
+
+        template<class U>
+        bool
+        operator==(const block_allocator_t<U>& other) const {
+            return m_arena == other.m_arena;
+        }
+
+        template<class U>
+        bool
+        operator!=(const block_allocator_t<U>& other) const {
+            return m_arena != other.m_arena;
+        }
+
+        arena_t *m_arena;
+        arena_pool_t *m_pool;
+    };
+
+    struct ignore_t {
+        void
+        operator()(arena_t * /* arena */) const {
+            // The arena is released by the allocator.
+        }
+    };
+
+public:
+    arena_pool_t(size_t capacity = 1024,
+                 size_t block_size = 4096) :
+        m_capacity(capacity),
+        m_block_size(block_size)
+    {
+        // pass
+    }
+
+    ~arena_pool_t() {
+        for (auto it = m_arenas.begin(); it != m_arenas.end(); ++it) {
+            delete *it;
+        }
+    }
+
+    std::shared_ptr<arena_t>
+    acquire() {
+        arena_t *arena = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (!m_arenas.empty()) {
+                arena = m_arenas.back();
+                m_arenas.pop_back();
+            }
+        }
+
+        if (!arena) {
+            arena = new arena_t(m_block_size);
+        }
+
+        return std::shared_ptr<arena_t>(
+            arena,
+            ignore_t(),
+            block_allocator_t<arena_t>(arena, this)
+        );
+    }
+
+private:
+    void
+    release(arena_t *arena) {
+        arena->reset();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_arenas.size() < m_capacity) {
+                m_arenas.push_back(arena);
+                return;
+            }
+        }
+
+        delete arena;
+    }
+
+private:
+    const size_t m_capacity;
+    const size_t m_block_size;
+
+    std::mutex m_mutex;
+    std::vector<arena_t*> m_arenas;
+};
+
+#endif // COCAINE_GRAPE_ARENA
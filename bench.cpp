@@ -0,0 +1,839 @@
+// Micro-benchmarks of the worker's hot paths, run with 'make bench'. Every
+// benchmark reports the time and the number of heap allocations per
+// operation, to serve as a baseline for changes to the worker.
+
+#include "worker.hpp"
+#include "http_request.hpp"
+#include "memo_cache.hpp"
+#include "response_template.hpp"
+#include "typed_handler.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace cocaine;
+
+namespace {
+    std::atomic<size_t> allocations(0);
+}
+
+void*
+operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    void *ptr = std::malloc(size ? size : 1);
+
+    if(!ptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void
+operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+    typedef std::chrono::steady_clock clock_type;
+
+    template<class F>
+    void
+    run(const std::string& name,
+        size_t iterations,
+        F f)
+    {
+        for(size_t i = 0; i < iterations / 10; ++i) {
+            f(i);
+        }
+
+        const size_t before = allocations.load(std::memory_order_relaxed);
+        const clock_type::time_point start = clock_type::now();
+
+        for(size_t i = 0; i < iterations; ++i) {
+            f(i);
+        }
+
+        const double elapsed = std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+        const size_t allocated = allocations.load(std::memory_order_relaxed) - before;
+
+        std::printf(
+            "%-56s %10.1f ns/op %8.2f allocs/op\n",
+            name.c_str(),
+            elapsed / iterations,
+            static_cast<double>(allocated) / iterations
+        );
+    }
+
+    class null_stream_t:
+        public response_stream_t
+    {
+    public:
+        virtual
+        void
+        write(const char * /* chunk */,
+              size_t /* size */)
+        {
+            // pass
+        }
+
+        // NOTE: The upstream hands the segments to the writer as they are.
+        virtual
+        void
+        write(const iovec * /* iov */,
+              size_t /* count */)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        error(error_code /* code */,
+              const std::string& /* message */)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        close() {
+            // pass
+        }
+    };
+
+    class null_logger_t:
+        public logger::logger_t
+    {
+    public:
+        null_logger_t(logging::priorities verbosity):
+            m_verbosity(verbosity)
+        {
+            // pass
+        }
+
+        virtual
+        logging::priorities
+        verbosity() const {
+            return m_verbosity;
+        }
+
+        virtual
+        void
+        emit(logging::priorities /* priority */,
+             const std::string& /* source */,
+             const std::string& /* message */)
+        {
+            // pass
+        }
+
+    private:
+        const logging::priorities m_verbosity;
+    };
+
+    class bench_app_t:
+        public application_t
+    {
+    public:
+        class on_event:
+            public handler_t<bench_app_t>
+        {
+        public:
+            on_event(bench_app_t& a):
+                handler_t<bench_app_t>(a)
+            {
+                // pass
+            }
+
+            virtual
+            void
+            invoke(const std::string& /* event */,
+                   std::shared_ptr<response_stream_t> response)
+            {
+                m_response = response;
+            }
+
+            virtual
+            void
+            write(const char * /* chunk */,
+                  size_t /* size */)
+            {
+                // pass
+            }
+
+            virtual
+            void
+            error(error_code /* code */,
+                  const std::string& /* message */)
+            {
+                // pass
+            }
+
+            virtual
+            void
+            close() {
+                m_response->close();
+            }
+
+            virtual
+            void
+            reset() {
+                m_response.reset();
+            }
+
+        private:
+            std::shared_ptr<response_stream_t> m_response;
+        };
+
+    public:
+        bench_app_t(size_t events,
+                    bool pooled)
+        {
+            for(size_t i = 0; i < events; ++i) {
+                if(pooled) {
+                    on<on_event, pooled_factory_t>(format("event%d", i));
+                } else {
+                    on<on_event>(format("event%d", i));
+                }
+            }
+        }
+
+        void
+        start() {
+            initialize("bench", std::make_shared<null_logger_t>(logging::ignore));
+        }
+
+        std::string
+        on_method(const std::string& /* event */,
+                  const std::vector<std::string>& /* input */)
+        {
+            return std::string();
+        }
+
+        void
+        on_fold(size_t& length,
+                const char * /* chunk */,
+                size_t size,
+                response_stream_t& /* response */)
+        {
+            length += size;
+        }
+
+        std::string
+        on_finalize(size_t& /* length */,
+                    const std::string& /* event */)
+        {
+            return std::string();
+        }
+    };
+
+    std::string
+    concatenate(const std::string& /* event */,
+                const std::vector<std::string>& input)
+    {
+        size_t size = 0;
+
+        for(auto it = input.begin(); it != input.end(); ++it) {
+            size += it->size();
+        }
+
+        return std::string(size ? 1 : 0, 'x');
+    }
+
+    void
+    bench_dispatch() {
+        const size_t counts[] = { 4, 16, 64, 256 };
+        auto stream = std::make_shared<null_stream_t>();
+
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            for(int pooled = 0; pooled < 2; ++pooled) {
+                bench_app_t app(counts[c], pooled);
+                app.start();
+
+                std::vector<std::string> events;
+
+                for(size_t i = 0; i < counts[c]; ++i) {
+                    events.push_back(format("event%d", i));
+                }
+
+                run(format("invoke, %d events%s", counts[c], pooled ? ", pooled handlers" : ""), 1000000, [&](size_t i) {
+                    app.invoke(events[i % events.size()], stream);
+                });
+            }
+        }
+    }
+
+    void
+    bench_factory(const std::string& name,
+                  base_factory_t& factory)
+    {
+        run("make_handler, " + name, 1000000, [&](size_t) {
+            factory.make_handler();
+        });
+    }
+
+    void
+    bench_factories() {
+        bench_app_t app(0, false);
+
+        handler_factory_t<bench_app_t::on_event> plain;
+        pooled_factory_t<bench_app_t::on_event> pooled;
+        method_factory_t<bench_app_t> method(&bench_app_t::on_method);
+        method_factory_t<bench_app_t> pooled_method(&bench_app_t::on_method, 1024);
+        function_factory_t function(&concatenate);
+        function_factory_t pooled_function(&concatenate, 1024);
+        streaming_method_factory_t<bench_app_t, size_t> streaming(&bench_app_t::on_fold, &bench_app_t::on_finalize);
+        streaming_method_factory_t<bench_app_t, size_t> pooled_streaming(&bench_app_t::on_fold, &bench_app_t::on_finalize, 1024);
+
+        bench_factory("handler_factory_t", *plain.rebind(&app));
+        bench_factory("pooled_factory_t", *pooled.rebind(&app));
+        bench_factory("method_factory_t", *method.rebind(&app));
+        bench_factory("method_factory_t, pooled", *pooled_method.rebind(&app));
+        bench_factory("function_factory_t", function);
+        bench_factory("function_factory_t, pooled", pooled_function);
+        bench_factory("streaming_method_factory_t", *streaming.rebind(&app));
+        bench_factory("streaming_method_factory_t, pooled", *pooled_streaming.rebind(&app));
+    }
+
+    // Same layout as the worker's stream map entries.
+    struct io_pair_t {
+        std::shared_ptr<api::stream_t> upstream;
+        std::shared_ptr<api::stream_t> downstream;
+
+        timer_wheel_t<uint64_t>::handle_type timer;
+        uint64_t idle;
+        uint64_t expires;
+
+        std::shared_ptr<std::atomic<bool>> cancelled;
+    };
+
+    void
+    bench_sessions() {
+        const size_t counts[] = { 10000, 100000 };
+        auto stream = std::make_shared<null_stream_t>();
+
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            const size_t live = counts[c];
+
+            session_table_t<io_pair_t> sessions;
+            io_pair_t io = { stream, stream, timer_wheel_t<uint64_t>::npos, 0, 0, std::make_shared<std::atomic<bool>>(false) };
+
+            for(uint64_t id = 1; id <= live; ++id) {
+                sessions.insert(id, io);
+            }
+
+            // The engine numbers the sessions sequentially, so in a steady
+            // state the oldest one finishes as a new one comes in.
+            uint64_t next = live + 1;
+
+            run(format("session table insert+find+erase, %d sessions", live), 1000000, [&](size_t) {
+                sessions.insert(next, io);
+                sessions.find(next - live / 2);
+                sessions.erase(next - live);
+                ++next;
+            });
+
+            volatile size_t found = 0;
+
+            run(format("session table find, %d sessions", live), 1000000, [&](size_t i) {
+                found += sessions.find(next - 1 - i % live) != nullptr;
+            });
+        }
+    }
+
+    void
+    bench_deadlines() {
+        const size_t counts[] = { 10000, 100000 };
+
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            const size_t live = counts[c];
+
+            timer_wheel_t<uint64_t> wheel;
+            std::vector<timer_wheel_t<uint64_t>::handle_type> handles(live);
+
+            // A tick being 50ms, the deadlines are spread over a minute.
+            for(uint64_t id = 0; id < live; ++id) {
+                handles[id] = wheel.schedule(id % 1200, id);
+            }
+
+            uint64_t tick = 0;
+
+            run(format("timer wheel reschedule on a chunk, %d sessions", live), 1000000, [&](size_t i) {
+                const size_t id = i % live;
+                handles[id] = wheel.reschedule(handles[id], tick + 200 + i % 1000);
+            });
+
+            run(format("timer wheel schedule+cancel, %d sessions", live), 1000000, [&](size_t i) {
+                wheel.cancel(wheel.schedule(tick + 200 + i % 1000, i));
+            });
+
+            volatile size_t expired = 0;
+
+            run(format("timer wheel tick, %d sessions", live), 10000, [&](size_t) {
+                wheel.advance(tick++, [&](uint64_t id) {
+                    ++expired;
+                    handles[id] = wheel.schedule(tick + 1200, id);
+                });
+            });
+        }
+    }
+
+    void
+    bench_writer() {
+        int fds[2];
+
+        if(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            std::perror("unable to create a socket pair");
+            return;
+        }
+
+        std::thread drain([&] {
+            std::vector<char> buffer(1 << 16);
+
+            while(::recv(fds[1], buffer.data(), buffer.size(), 0) > 0) {
+                // pass
+            }
+        });
+
+        {
+            io::service_t service;
+            writer_t writer(service, std::make_shared<io::socket<io::local>>(fds[0]));
+
+            const std::string payload(64, 'x');
+            iovec iov[3] = {
+                { const_cast<char*>(payload.data()), 16 },
+                { const_cast<char*>(payload.data()), 32 },
+                { const_cast<char*>(payload.data()), 16 }
+            };
+
+            // A chunk aborted by another message must fail to commit, even if
+            // the handler keeps writing through it in the meantime.
+            {
+                chunk_writer_t& chunk = writer.begin_chunk(1);
+
+                writer.write<io::rpc::choke>(static_cast<uint64_t>(2));
+                msgpack::packer<chunk_writer_t>(chunk).pack(payload);
+
+                bool aborted = false;
+
+                try {
+                    writer.commit_chunk(1);
+                } catch(const cocaine::error_t&) {
+                    aborted = true;
+                }
+
+                if(!aborted) {
+                    std::fprintf(stderr, "an aborted chunk has been committed\n");
+                    std::abort();
+                }
+            }
+
+            // NOTE: Output is flushed every 64 messages, as in batched mode.
+            writer.cork();
+
+            run("writer write, 64 byte chunk", 10000000, [&](size_t i) {
+                writer.write(i, iov, 1);
+
+                if((i & 63) == 63) {
+                    writer.uncork();
+                    writer.cork();
+                }
+            });
+
+            run("writer write, 64 byte chunk in 3 segments", 10000000, [&](size_t i) {
+                writer.write(i, iov, 3);
+
+                if((i & 63) == 63) {
+                    writer.uncork();
+                    writer.cork();
+                }
+            });
+
+            // The way a handler producing msgpack used to do it, packing into
+            // a buffer of its own first.
+            run("writer write, 64 byte msgpack chunk packed aside", 10000000, [&](size_t i) {
+                msgpack::sbuffer buffer;
+                msgpack::pack(buffer, payload);
+
+                iovec chunk = { buffer.data(), buffer.size() };
+                writer.write(i, &chunk, 1);
+
+                if((i & 63) == 63) {
+                    writer.uncork();
+                    writer.cork();
+                }
+            });
+
+            run("writer write, 64 byte msgpack chunk packed in place", 10000000, [&](size_t i) {
+                msgpack::packer<chunk_writer_t> packer(writer.begin_chunk(i));
+                packer.pack(payload);
+                writer.commit_chunk(i);
+
+                if((i & 63) == 63) {
+                    writer.uncork();
+                    writer.cork();
+                }
+            });
+
+            run("writer choke", 10000000, [&](size_t i) {
+                writer.write<io::rpc::choke>(static_cast<uint64_t>(i));
+
+                if((i & 63) == 63) {
+                    writer.uncork();
+                    writer.cork();
+                }
+            });
+
+            writer.uncork();
+
+            // Lets the drain see the end of the stream.
+            ::shutdown(fds[0], SHUT_WR);
+        }
+
+        drain.join();
+
+        ::close(fds[1]);
+    }
+
+    void
+    bench_accumulation() {
+        auto stream = std::make_shared<null_stream_t>();
+        const std::string chunk(1024, 'x');
+
+        const size_t counts[] = { 1, 16 };
+
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            const size_t chunks = counts[c];
+
+            function_handler_t handler(&concatenate);
+
+            run(format("function_handler_t, %d x 1KB chunks", chunks), 200000, [&](size_t) {
+                handler.invoke("event", stream);
+
+                for(size_t i = 0; i < chunks; ++i) {
+                    handler.write(chunk.data(), chunk.size());
+                }
+
+                handler.close();
+                handler.reset();
+            });
+
+            function_handler_t spilling(&concatenate, 1);
+
+            run(format("function_handler_t, %d x 1KB chunks, spilled", chunks), 200000, [&](size_t) {
+                spilling.invoke("event", stream);
+
+                for(size_t i = 0; i < chunks; ++i) {
+                    spilling.write(chunk.data(), chunk.size());
+                }
+
+                spilling.close();
+                spilling.reset();
+            });
+
+            streaming_handler_t<size_t> streaming(
+                [](size_t& length, const char *, size_t size, response_stream_t&) { length += size; },
+                [](size_t&, const std::string&) { return std::string(); }
+            );
+
+            run(format("streaming_handler_t, %d x 1KB chunks", chunks), 200000, [&](size_t) {
+                streaming.invoke("event", stream);
+
+                for(size_t i = 0; i < chunks; ++i) {
+                    streaming.write(chunk.data(), chunk.size());
+                }
+
+                streaming.close();
+                streaming.reset();
+            });
+        }
+    }
+
+    void
+    bench_templates() {
+        null_stream_t stream;
+
+        run("response headers, packed per request", 1000000, [&](size_t) {
+            msgpack::sbuffer buffer;
+            msgpack::packer<msgpack::sbuffer> pk(&buffer);
+            pk.pack_map(2);
+            pk.pack(std::string("code"));
+            pk.pack(200);
+
+            std::vector<std::pair<std::string, std::string>> headers;
+            headers.push_back(std::make_pair(std::string("Content-Type"), std::string("text/plain")));
+
+            pk.pack(std::string("headers"));
+            pk.pack(headers);
+
+            stream.write(buffer.data(), buffer.size());
+        });
+
+        const response_template_t ok(200, {
+            response_template_t::header_type("Content-Type", "text/plain")
+        });
+
+        run("response headers, template", 1000000, [&](size_t) {
+            ok.write(stream);
+        });
+
+        const response_template_t::header_type extra[] = {
+            response_template_t::header_type("X-Request-Id", "ea6ab4b4-39b8-4d1c-9c8f-0f7a09a1b3e2")
+        };
+
+        run("response headers, template with a dynamic header", 1000000, [&](size_t) {
+            ok.write(stream, extra, 1);
+        });
+
+        std::shared_ptr<arena_pool_t> pool(std::make_shared<arena_pool_t>());
+
+        class arena_stream_t:
+            public null_stream_t
+        {
+        public:
+            arena_stream_t(std::shared_ptr<arena_t> arena):
+                m_arena(arena)
+            {
+                // pass
+            }
+
+            virtual
+            std::shared_ptr<arena_t>
+            arena() const {
+                return m_arena;
+            }
+
+        private:
+            std::shared_ptr<arena_t> m_arena;
+        };
+
+        run("response headers, template with a dynamic header, arena", 1000000, [&](size_t) {
+            arena_stream_t session(pool->acquire());
+            ok.write(session, extra, 1);
+        });
+    }
+
+    void
+    bench_typed() {
+        typedef std::vector<std::map<std::string, std::vector<int64_t>>> request_type;
+
+        // A few hundred records of a dozen fields each, about 64KB encoded.
+        request_type request(256);
+
+        for(size_t i = 0; i < request.size(); ++i) {
+            for(size_t j = 0; j < 12; ++j) {
+                request[i][format("field%d", j)] = std::vector<int64_t>(8, i * j);
+            }
+        }
+
+        msgpack::sbuffer payload;
+        msgpack::pack(&payload, request);
+
+        const std::string suffix = format(", %d KB nested payload", payload.size() / 1024);
+
+        run("decode, zone per request" + suffix, 1000, [&](size_t) {
+            msgpack::unpacked unpacked;
+            msgpack::unpack(&unpacked, payload.data(), payload.size());
+
+            request_type decoded;
+            unpacked.get().convert(&decoded);
+        });
+
+        auto stream = std::make_shared<null_stream_t>();
+
+        typed_handler_t<request_type, size_t> handler([](const request_type& r) {
+            return r.size();
+        });
+
+        run("decode, typed handler" + suffix, 1000, [&](size_t) {
+            handler.invoke("typed", stream);
+            handler.write(payload.data(), payload.size());
+            handler.close();
+            handler.reset();
+        });
+    }
+
+    void
+    bench_http() {
+        typedef std::pair<std::string, std::string> header_type;
+
+        std::vector<header_type> headers;
+        headers.push_back(header_type("Host", "example.com"));
+        headers.push_back(header_type("User-Agent", "Mozilla/5.0 (X11; Linux x86_64; rv:31.0) Gecko/20100101 Firefox/31.0"));
+        headers.push_back(header_type("Accept", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"));
+        headers.push_back(header_type("Accept-Language", "en-US,en;q=0.5"));
+        headers.push_back(header_type("Accept-Encoding", "gzip, deflate"));
+        headers.push_back(header_type("Cookie", "yandexuid=1234567890123456789; fuid01=5372a4f05ea1ad3d"));
+        headers.push_back(header_type("Connection", "keep-alive"));
+        headers.push_back(header_type("X-Forwarded-For", "2a02:6b8::1"));
+        headers.push_back(header_type("X-Real-IP", "2a02:6b8::1"));
+        headers.push_back(header_type("X-Request-Id", "ea6ab4b4-39b8-4d1c-9c8f-0f7a09a1b3e2"));
+        headers.push_back(header_type("Content-Type", "application/x-www-form-urlencoded"));
+        headers.push_back(header_type("Content-Length", "1024"));
+
+        msgpack::sbuffer envelope;
+        msgpack::packer<msgpack::sbuffer> packer(&envelope);
+
+        packer.pack_array(5);
+        packer.pack(std::string("POST"));
+        packer.pack(std::string("/search?text=cocaine&lr=213"));
+        packer.pack(std::string("1.1"));
+        packer.pack(headers);
+        packer.pack(std::string(1024, 'x'));
+
+        run("http request, full decode", 1000000, [&](size_t) {
+            msgpack::unpacked unpacked;
+            msgpack::unpack(&unpacked, envelope.data(), envelope.size());
+
+            const msgpack::object& object = unpacked.get();
+
+            std::string method, uri, version, body;
+            std::vector<header_type> decoded;
+
+            object.via.array.ptr[0].convert(&method);
+            object.via.array.ptr[1].convert(&uri);
+            object.via.array.ptr[2].convert(&version);
+            object.via.array.ptr[3].convert(&decoded);
+            object.via.array.ptr[4].convert(&body);
+        });
+
+        run("http request, index, uri", 1000000, [&](size_t) {
+            http_request_t request;
+            request.parse(envelope.data(), envelope.size());
+            request.uri();
+        });
+
+        run("http request, index, uri and a header", 1000000, [&](size_t) {
+            http_request_t request;
+            request.parse(envelope.data(), envelope.size());
+            request.uri();
+            request.header("content-type", 12);
+        });
+    }
+
+    void
+    bench_memo() {
+        const std::string input(256, 'x');
+        const memo_cache_t::response_type response(1, std::string(1024, 'y'));
+
+        run("memo hash, 256 byte input", 10000000, [&](size_t) {
+            memo_cache_t::hash(input.data(), input.size());
+        });
+
+        run("memo hash, 256 byte input, fnv-1a", 10000000, [&](size_t) {
+            dispatch_table_t<void>::hash(input.data(), input.size());
+        });
+
+        // Room for about 500 entries, so the smaller working set is all hits
+        // and the larger one keeps missing and evicting.
+        const size_t keys[] = { 100, 1000 };
+
+        for(size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); ++k) {
+            memo_cache_t cache(512 * (input.size() + 1024 + 64));
+
+            std::vector<std::string> inputs;
+
+            for(size_t i = 0; i < keys[k]; ++i) {
+                inputs.push_back(format("%d", i) + input);
+            }
+
+            run(format("memo lookup, %d distinct inputs", keys[k]), 1000000, [&](size_t i) {
+                const std::string& key = inputs[(i * 7919) % inputs.size()];
+                const uint64_t hash = memo_cache_t::hash(key.data(), key.size());
+
+                if(!cache.find(hash, key)) {
+                    cache.insert(hash, key, response);
+                }
+            });
+
+            const memo_cache_t::stats_t& stats = cache.stats();
+
+            std::printf(
+                "%-56s %llu hits, %llu misses, %llu evictions\n",
+                "",
+                static_cast<unsigned long long>(stats.hits),
+                static_cast<unsigned long long>(stats.misses),
+                static_cast<unsigned long long>(stats.evictions)
+            );
+        }
+    }
+
+    void
+    bench_logging() {
+        const std::string id("ea6ab4b4-39b8-4d1c-9c8f-0f7a09a1b3e2");
+        const std::string event("event1");
+
+        auto enabled = std::make_shared<logger::log_t>(std::make_shared<null_logger_t>(logging::debug), "bench");
+        auto disabled = std::make_shared<logger::log_t>(std::make_shared<null_logger_t>(logging::info), "bench");
+
+        run("invoke debug log line, enabled", 1000000, [&](size_t i) {
+            COCAINE_LOG_DEBUG(enabled, "worker %s invoking session %s with event '%s'", id, i, event);
+        });
+
+        run("invoke debug log line, disabled at runtime", 1000000, [&](size_t i) {
+            COCAINE_LOG_DEBUG(disabled, "worker %s invoking session %s with event '%s'", id, i, event);
+        });
+    }
+
+    void
+    bench_arena() {
+        // Stands in for the per-session upstream and the handler's data.
+        struct session_t {
+            uint64_t id;
+            char state[48];
+        };
+
+        run("session objects, heap", 1000000, [&](size_t i) {
+            auto session = std::make_shared<session_t>();
+            std::vector<char> data(256);
+
+            session->id = i;
+        });
+
+        std::shared_ptr<arena_pool_t> pool(std::make_shared<arena_pool_t>());
+
+        run("session objects, pooled arena", 1000000, [&](size_t i) {
+            std::shared_ptr<arena_t> arena(pool->acquire());
+
+            auto session = std::allocate_shared<session_t>(arena_allocator_t<session_t>(arena));
+            std::vector<char, arena_allocator_t<char>> data(256, 0, arena_allocator_t<char>(arena));
+
+            session->id = i;
+        });
+    }
+}
+
+int
+main() {
+    bench_dispatch();
+    bench_factories();
+    bench_sessions();
+    bench_deadlines();
+    bench_writer();
+    bench_accumulation();
+    bench_templates();
+    bench_typed();
+    bench_http();
+    bench_memo();
+    bench_logging();
+    bench_arena();
+
+    rusage usage;
+
+    if(::getrusage(RUSAGE_SELF, &usage) == 0) {
+        std::printf("peak rss: %ld KB\n", usage.ru_maxrss);
+    }
+
+    return 0;
+}
@@ -0,0 +1,336 @@
+#ifndef COCAINE_GRAPE_COROUTINE
+#define COCAINE_GRAPE_COROUTINE
+
+#include <boost/version.hpp>
+
+#if BOOST_VERSION >= 106900
+#define COCAINE_GRAPE_HAVE_COROUTINES
+
+#include <deque>
+#include <exception>
+#include <memory>
+#include <boost/context/fiber.hpp>
+#include <boost/context/pooled_fixedsize_stack.hpp>
+
+#include "worker.hpp"
+
+// A handler written as straight-line code instead of a callback state machine.
+// The body, run(), executes on its own stack and suspends in read() until the
+// next chunk arrives, so a long-lived session costs a suspended stack and no
+// thread. The body may write to the response at any point, and suspends in
+// wait_writable() while the channel to the engine is congested.
+template<class AppT>
+class coroutine_handler_t :
+    public handler_t<AppT>
+{
+    enum class state_t: int {
+        open,
+        closed,
+        failed
+    };
+
+public:
+    coroutine_handler_t(AppT& a,
+                        size_t stack_size = 64 * 1024) :
+        handler_t<AppT>(a),
+        m_stacks(stack_size, 1),
+        m_state(state_t::open),
+        m_chunk(nullptr),
+        m_size(0),
+        m_error_code(cocaine::error_code()),
+        m_running(false),
+        m_waiting(false),
+        m_drained(false)
+    {
+        // pass
+    }
+
+    // NOTE: A body still suspended is unwound here, see finish().
+    ~coroutine_handler_t() {
+        finish();
+        forget_drain();
+    }
+
+    void
+    invoke(const std::string& event,
+           std::shared_ptr<response_stream_t> response)
+    {
+        m_event = event;
+        m_response = response;
+
+        m_coroutine = boost::context::fiber(
+            std::allocator_arg,
+            m_stacks,
+            [this](boost::context::fiber&& caller) -> boost::context::fiber {
+                m_caller = std::move(caller);
+
+                try {
+                    run();
+                } catch(const boost::context::detail::forced_unwind&) {
+                    throw;
+                } catch(...) {
+                    m_exception = std::current_exception();
+                }
+
+                m_running = false;
+
+                return std::move(m_caller);
+            }
+        );
+
+        m_running = true;
+        resume();
+    }
+
+    void
+    write(const char *chunk,
+          size_t size)
+    {
+        // NOTE: The body isn't reading while it waits for the channel, so the
+        // chunk has to leave the receive buffer until it does.
+        if(m_waiting) {
+            m_backlog.push_back(std::string(chunk, size));
+            return;
+        }
+
+        m_chunk = chunk;
+        m_size = size;
+        resume();
+    }
+
+    void
+    close() {
+        m_state = state_t::closed;
+        resume();
+    }
+
+    void
+    error(cocaine::error_code code,
+          const std::string& message)
+    {
+        m_state = state_t::failed;
+        m_error_code = code;
+        m_error_message = message;
+        resume();
+    }
+
+    void
+    reset() {
+        // NOTE: The unwound stack goes back to the pool for the next session.
+        finish();
+        forget_drain();
+        m_waiting = false;
+        m_drained = false;
+        m_backlog.clear();
+        m_current.clear();
+        m_state = state_t::open;
+        m_chunk = nullptr;
+        m_size = 0;
+        m_error_code = cocaine::error_code();
+        m_error_message.clear();
+        m_exception = std::exception_ptr();
+        m_event.clear();
+        m_response.reset();
+    }
+
+protected:
+    // The body of the handler.
+    virtual
+    void
+    run() = 0;
+
+    // Suspends until the next chunk arrives. The chunk is a view into the
+    // receive buffer, valid until the next call; use retain() to keep it.
+    // Returns false once the request is over, either because the engine has
+    // closed the stream or because of an error().
+    bool
+    read(const char *& chunk,
+         size_t& size)
+    {
+        if(!m_backlog.empty()) {
+            m_current.swap(m_backlog.front());
+            m_backlog.pop_front();
+
+            chunk = m_current.data();
+            size = m_current.size();
+
+            return true;
+        }
+
+        m_chunk = nullptr;
+
+        while(!m_chunk && m_state == state_t::open) {
+            m_caller = std::move(m_caller).resume();
+        }
+
+        if(!m_chunk) {
+            return false;
+        }
+
+        chunk = m_chunk;
+        size = m_size;
+
+        m_chunk = nullptr;
+
+        return true;
+    }
+
+    // Suspends until the response is writable again, see on_drain(). Input
+    // arriving in the meantime is kept for read(), but the chunk the last
+    // read() has returned may not survive it. Returns false if the session
+    // has failed instead.
+    bool
+    wait_writable() {
+        if(m_response->writable()) {
+            return true;
+        }
+
+        if(!m_waiter) {
+            m_waiter = std::make_shared<coroutine_handler_t*>(this);
+        }
+
+        const std::shared_ptr<coroutine_handler_t*> waiter(m_waiter);
+
+        m_drained = false;
+
+        // NOTE: The callback may run right away, before the body suspends.
+        m_response->on_drain([waiter] {
+            if(*waiter) {
+                (*waiter)->drained();
+            }
+        });
+
+        m_waiting = true;
+
+        while(!m_drained && m_state != state_t::failed) {
+            m_caller = std::move(m_caller).resume();
+        }
+
+        m_waiting = false;
+
+        return m_drained;
+    }
+
+    // Unwinds the body if it is still suspended, running the destructors of
+    // whatever is on its stack. The base destructor does it too, but only once
+    // the derived class is gone, so derived classes whose body relies on their
+    // own members must call it from their destructors.
+    void
+    finish() {
+        m_coroutine = boost::context::fiber();
+        m_caller = boost::context::fiber();
+        m_running = false;
+    }
+
+    // Set once read() has returned false because of an error.
+    bool
+    failed() const {
+        return m_state == state_t::failed;
+    }
+
+    cocaine::error_code
+    error_code() const {
+        return m_error_code;
+    }
+
+    const std::string&
+    error_message() const {
+        return m_error_message;
+    }
+
+    const std::string&
+    event() const {
+        return m_event;
+    }
+
+    const std::shared_ptr<response_stream_t>&
+    response() const {
+        return m_response;
+    }
+
+private:
+    // Runs on the handler's thread once the response is writable again.
+    void
+    drained() {
+        m_drained = true;
+
+        if(!m_waiting) {
+            return;
+        }
+
+        // NOTE: Nobody is there to report a failure of the body on behalf of
+        // the drain, so the handler does it.
+        try {
+            resume();
+        } catch(const std::exception& e) {
+            fail(e.what());
+        } catch(...) {
+            fail("unexpected exception");
+        }
+    }
+
+    void
+    fail(const std::string& message) {
+        try {
+            m_response->error(cocaine::invocation_error, message);
+        } catch(...) {
+            // pass
+        }
+    }
+
+    // Pending drain callbacks must not reach the handler once the session
+    // is over.
+    void
+    forget_drain() {
+        if(m_waiter) {
+            *m_waiter = nullptr;
+            m_waiter.reset();
+        }
+    }
+
+    void
+    resume() {
+        // NOTE: Input arriving after the body has finished is dropped.
+        if(!m_running) {
+            return;
+        }
+
+        m_coroutine = std::move(m_coroutine).resume();
+
+        if(m_exception) {
+            std::exception_ptr exception = m_exception;
+            m_exception = std::exception_ptr();
+            std::rethrow_exception(exception);
+        }
+    }
+
+private:
+    // Keeps the stack for the next session of a pooled handler.
+    boost::context::pooled_fixedsize_stack m_stacks;
+
+    boost::context::fiber m_coroutine;
+    boost::context::fiber m_caller;
+
+    state_t m_state;
+    const char *m_chunk;
+    size_t m_size;
+    cocaine::error_code m_error_code;
+    std::string m_error_message;
+
+    std::exception_ptr m_exception;
+    bool m_running;
+
+    // Flow control, see wait_writable().
+    bool m_waiting;
+    bool m_drained;
+    std::shared_ptr<coroutine_handler_t*> m_waiter;
+    std::deque<std::string> m_backlog;
+    std::string m_current;
+
+    std::string m_event;
+    std::shared_ptr<response_stream_t> m_response;
+};
+
+#endif // BOOST_VERSION >= 106900
+
+#endif // COCAINE_GRAPE_COROUTINE
@@ -0,0 +1,94 @@
+#ifndef COCAINE_GRAPE_DISPATCH
+#define COCAINE_GRAPE_DISPATCH
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Flat open-addressing table mapping event names to raw pointers. It is built
+// once from the registration map when the application is frozen and is then
+// only read, so lookups don't touch the tree nor any reference counters.
+template<class T>
+class dispatch_table_t {
+    struct entry_t {
+        uint64_t hash;
+        T *value;
+        std::string name;
+    };
+
+public:
+    dispatch_table_t() :
+        m_mask(0)
+    {
+        // pass
+    }
+
+    // FNV-1a, good enough for short identifiers and cheap to compute inline.
+    static
+    uint64_t
+    hash(const char *data,
+         size_t size)
+    {
+        uint64_t result = 14695981039346656037ULL;
+
+        for (size_t i = 0; i < size; ++i) {
+            result ^= static_cast<unsigned char>(data[i]);
+            result *= 1099511628211ULL;
+        }
+
+        return result;
+    }
+
+    void
+    build(const std::map<std::string, std::shared_ptr<T>>& values) {
+        // Keep the load factor at or below one half, so probe sequences stay
+        // within a cache line or two.
+        size_t capacity = 1;
+
+        while (capacity < values.size() * 2) {
+            capacity <<= 1;
+        }
+
+        m_entries.assign(capacity, entry_t());
+        m_mask = capacity - 1;
+
+        for (auto it = values.begin(); it != values.end(); ++it) {
+            entry_t entry = { hash(it->first.data(), it->first.size()), it->second.get(), it->first };
+
+            size_t index = entry.hash & m_mask;
+
+            while (m_entries[index].value) {
+                index = (index + 1) & m_mask;
+            }
+
+            m_entries[index] = entry;
+        }
+    }
+
+    T*
+    find(const std::string& name) const {
+        if (m_entries.empty()) {
+            return nullptr;
+        }
+
+        const uint64_t h = hash(name.data(), name.size());
+
+        for (size_t index = h & m_mask; m_entries[index].value; index = (index + 1) & m_mask) {
+            const entry_t& entry = m_entries[index];
+
+            if (entry.hash == h && entry.name == name) {
+                return entry.value;
+            }
+        }
+
+        return nullptr;
+    }
+
+private:
+    std::vector<entry_t> m_entries;
+    size_t m_mask;
+};
+
+#endif // COCAINE_GRAPE_DISPATCH
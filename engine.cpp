@@ -0,0 +1,686 @@
+// Stand-in for the cocaine engine, used to load test a worker in isolation.
+// It listens on a unix socket, optionally spawns the worker pointed at it,
+// answers the handshake and heartbeats, and then drives a mix of sessions
+// (invoke, a number of chunks, choke) against the worker's events, either
+// keeping a fixed number of them in flight or starting them at a fixed rate
+// regardless of how fast the worker answers. Reports the throughput and the
+// latency distribution from the invoke to the worker's choke per event.
+//
+// For example, to spawn the worker and keep 64 sessions in flight:
+//
+//   engine --worker ./application --mix event2:3:1,length:1:16 --concurrency 64
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/program_options.hpp>
+#include <cocaine/messages.hpp>
+#include <msgpack.hpp>
+
+using namespace cocaine;
+
+namespace {
+    typedef std::chrono::steady_clock clock_type;
+
+    struct buffer_t {
+        void
+        write(const char *data,
+              size_t size)
+        {
+            bytes.insert(bytes.end(), data, data + size);
+        }
+
+        std::vector<char> bytes;
+    };
+
+    // An event to invoke, how often relative to the others and with how
+    // many chunks of input.
+    struct event_t {
+        event_t():
+            weight(1),
+            chunks(1),
+            started(0),
+            completed(0),
+            errors(0),
+            latency(new histogram_t())
+        {
+            // pass
+        }
+
+        std::string name;
+        unsigned weight;
+        unsigned chunks;
+
+        uint64_t started;
+        uint64_t completed;
+        uint64_t errors;
+
+        // Microseconds from the invoke (or from the moment it was due, in
+        // open-loop mode) to the choke.
+        std::shared_ptr<histogram_t> latency;
+    };
+
+    struct session_t {
+        size_t event;
+        clock_type::time_point start;
+        bool failed;
+    };
+
+    // Parses "name[:weight[:chunks]],...".
+    std::vector<event_t>
+    parse_mix(const std::string& mix) {
+        std::vector<event_t> events;
+        size_t begin = 0;
+
+        while(begin < mix.size()) {
+            size_t end = mix.find(',', begin);
+
+            if(end == std::string::npos) {
+                end = mix.size();
+            }
+
+            const std::string spec(mix.substr(begin, end - begin));
+            const size_t first = spec.find(':');
+
+            event_t event;
+
+            event.name = spec.substr(0, first);
+
+            if(first != std::string::npos) {
+                const size_t second = spec.find(':', first + 1);
+
+                event.weight = boost::lexical_cast<unsigned>(spec.substr(first + 1, second - first - 1));
+
+                if(second != std::string::npos) {
+                    event.chunks = boost::lexical_cast<unsigned>(spec.substr(second + 1));
+                }
+            }
+
+            events.push_back(event);
+            begin = end + 1;
+        }
+
+        return events;
+    }
+
+    std::string
+    make_uuid() {
+        std::random_device device;
+        std::uniform_int_distribution<int> digit(0, 15);
+        std::string uuid;
+
+        for(int i = 0; i < 32; ++i) {
+            if(i == 8 || i == 12 || i == 16 || i == 20) {
+                uuid += '-';
+            }
+
+            uuid += "0123456789abcdef"[digit(device)];
+        }
+
+        return uuid;
+    }
+}
+
+class engine_t {
+public:
+    struct options_t {
+        std::string endpoint;
+        std::string worker;
+        std::string app;
+        std::vector<std::string> worker_args;
+        std::vector<event_t> events;
+        size_t chunk_size;
+        size_t concurrency;
+        double rate;
+        size_t max_in_flight;
+        double duration;
+        double warmup;
+    };
+
+public:
+    engine_t(const options_t& options):
+        m_options(options),
+        m_events(options.events),
+        m_total_weight(0),
+        m_listener(-1),
+        m_fd(-1),
+        m_worker(-1),
+        m_offset(0),
+        m_next_session(1),
+        m_scheduled(0),
+        m_handshaken(false),
+        m_disowned(false),
+        m_random(std::random_device()()),
+        m_payload(options.chunk_size, 'x')
+    {
+        for(size_t i = 0; i < m_events.size(); ++i) {
+            m_total_weight += m_events[i].weight;
+        }
+    }
+
+    ~engine_t() {
+        if(m_fd != -1) {
+            ::close(m_fd);
+        }
+
+        if(m_listener != -1) {
+            ::close(m_listener);
+            ::unlink(m_options.endpoint.c_str());
+        }
+
+        if(m_worker > 0) {
+            ::kill(m_worker, SIGTERM);
+            ::waitpid(m_worker, nullptr, 0);
+        }
+    }
+
+    void
+    run();
+
+private:
+    void
+    listen();
+
+    void
+    spawn();
+
+    void
+    accept();
+
+    // Polls the worker's socket until the deadline, handling whatever comes.
+    void
+    poll(clock_type::time_point deadline);
+
+    void
+    on_message(const msgpack::object& message);
+
+    void
+    start_session(clock_type::time_point start);
+
+    void
+    send_pending();
+
+    template<class Event, typename... Args>
+    void
+    send(const Args&... args);
+
+    void
+    send_chunk(uint64_t session_id);
+
+    void
+    report(double elapsed) const;
+
+private:
+    const options_t m_options;
+    std::vector<event_t> m_events;
+    unsigned m_total_weight;
+
+    int m_listener;
+    int m_fd;
+    pid_t m_worker;
+
+    buffer_t m_output;
+    size_t m_offset;
+
+    msgpack::unpacker m_unpacker;
+
+    std::map<uint64_t, session_t> m_sessions;
+    uint64_t m_next_session;
+    uint64_t m_scheduled;
+
+    bool m_handshaken;
+    bool m_disowned;
+
+    clock_type::time_point m_spawned;
+    clock_type::time_point m_handshake;
+
+    std::mt19937 m_random;
+    const std::string m_payload;
+};
+
+template<class Event, typename... Args>
+void
+engine_t::send(const Args&... args) {
+    msgpack::packer<buffer_t> packer(m_output);
+
+    packer.pack_array(2);
+    packer.pack(static_cast<int>(io::event_traits<Event>::id));
+    packer.pack_array(sizeof...(args));
+
+    // NOTE: Packs the arguments in order.
+    int expand[] = { 0, (packer.pack(args), 0)... };
+    (void)expand;
+}
+
+void
+engine_t::send_chunk(uint64_t session_id) {
+    msgpack::packer<buffer_t> packer(m_output);
+
+    packer.pack_array(2);
+    packer.pack(static_cast<int>(io::event_traits<io::rpc::chunk>::id));
+    packer.pack_array(2);
+    packer.pack(session_id);
+    packer.pack_raw(m_payload.size());
+    packer.pack_raw_body(m_payload.data(), m_payload.size());
+}
+
+void
+engine_t::run() {
+    listen();
+
+    if(!m_options.worker.empty()) {
+        spawn();
+    }
+
+    accept();
+
+    // Nothing is sent before the worker introduces itself.
+    poll(clock_type::now() + std::chrono::seconds(10));
+
+    while(!m_handshaken) {
+        if(m_disowned) {
+            throw std::runtime_error("the worker has gone away before the handshake");
+        }
+
+        poll(clock_type::now() + std::chrono::seconds(10));
+    }
+
+    if(!m_options.worker.empty()) {
+        std::cout << "handshake received "
+                  << std::chrono::duration_cast<std::chrono::microseconds>(m_handshake - m_spawned).count()
+                  << " us after spawning the worker" << std::endl;
+    }
+
+    const bool open_loop = m_options.rate > 0.0;
+    const auto interval = std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(open_loop ? 1.0 / m_options.rate : 0.0)
+    );
+
+    const clock_type::time_point started = clock_type::now();
+    const clock_type::time_point measured = started + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(m_options.warmup)
+    );
+    const clock_type::time_point finished = measured + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(m_options.duration)
+    );
+
+    bool warm = m_options.warmup <= 0.0;
+
+    while(!m_disowned) {
+        const clock_type::time_point now = clock_type::now();
+
+        if(now >= finished) {
+            break;
+        }
+
+        if(!warm && now >= measured) {
+            // Start from a clean slate once the worker has warmed up.
+            for(auto it = m_events.begin(); it != m_events.end(); ++it) {
+                it->started = it->completed = it->errors = 0;
+                it->latency.reset(new histogram_t());
+            }
+
+            warm = true;
+        }
+
+        clock_type::time_point deadline = finished;
+
+        if(open_loop) {
+            // NOTE: Sessions are started when they are due, not when the
+            // worker is done with the previous ones, and their latency is
+            // counted from that moment, so a stalling worker can't hide it.
+            clock_type::time_point due = started + interval * m_scheduled;
+
+            while(due <= now && m_sessions.size() < m_options.max_in_flight) {
+                start_session(due);
+                due = started + interval * ++m_scheduled;
+            }
+
+            deadline = std::min(deadline, due);
+        } else {
+            while(m_sessions.size() < m_options.concurrency) {
+                start_session(now);
+            }
+        }
+
+        poll(deadline);
+    }
+
+    // Let the sessions in flight finish.
+    const clock_type::time_point drained = clock_type::now() + std::chrono::seconds(5);
+
+    while(!m_sessions.empty() && !m_disowned && clock_type::now() < drained) {
+        poll(drained);
+    }
+
+    report(std::chrono::duration<double>(std::min(clock_type::now(), finished) - measured).count());
+
+    if(!m_disowned) {
+        send<io::rpc::terminate>(static_cast<int>(io::rpc::terminate::normal), std::string("load test is over"));
+        send_pending();
+    }
+}
+
+void
+engine_t::listen() {
+    sockaddr_un address;
+
+    if(m_options.endpoint.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("the endpoint path is too long");
+    }
+
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, m_options.endpoint.c_str());
+
+    ::unlink(address.sun_path);
+
+    m_listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(m_listener == -1 ||
+       ::bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+       ::listen(m_listener, 1) != 0)
+    {
+        throw std::system_error(errno, std::system_category(), "unable to listen on the endpoint");
+    }
+}
+
+void
+engine_t::spawn() {
+    std::vector<std::string> args;
+
+    args.push_back(m_options.worker);
+    args.push_back("--app");
+    args.push_back(m_options.app);
+    args.push_back("--uuid");
+    args.push_back(make_uuid());
+    args.push_back("--endpoint");
+    args.push_back(m_options.endpoint);
+    args.insert(args.end(), m_options.worker_args.begin(), m_options.worker_args.end());
+
+    std::vector<char*> argv;
+
+    for(auto it = args.begin(); it != args.end(); ++it) {
+        argv.push_back(const_cast<char*>(it->c_str()));
+    }
+
+    argv.push_back(nullptr);
+
+    m_spawned = clock_type::now();
+    m_worker = ::fork();
+
+    if(m_worker == -1) {
+        throw std::system_error(errno, std::system_category(), "unable to fork the worker");
+    } else if(m_worker == 0) {
+        ::execv(argv[0], argv.data());
+        std::perror("unable to exec the worker");
+        std::_Exit(EXIT_FAILURE);
+    }
+}
+
+void
+engine_t::accept() {
+    pollfd event = { m_listener, POLLIN, 0 };
+
+    if(::poll(&event, 1, 10000) != 1) {
+        throw std::runtime_error("the worker hasn't connected");
+    }
+
+    m_fd = ::accept4(m_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if(m_fd == -1) {
+        throw std::system_error(errno, std::system_category(), "unable to accept the worker");
+    }
+}
+
+void
+engine_t::poll(clock_type::time_point deadline) {
+    send_pending();
+
+    const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_type::now()).count();
+
+    pollfd event = {
+        m_fd,
+        static_cast<short>(POLLIN | (m_offset < m_output.bytes.size() ? POLLOUT : 0)),
+        0
+    };
+
+    if(::poll(&event, 1, std::max<long>(timeout, 0)) <= 0) {
+        return;
+    }
+
+    if(event.revents & (POLLIN | POLLHUP | POLLERR)) {
+        while(true) {
+            m_unpacker.reserve_buffer(65536);
+
+            const ssize_t received = ::recv(m_fd, m_unpacker.buffer(), m_unpacker.buffer_capacity(), 0);
+
+            if(received == 0) {
+                m_disowned = true;
+                break;
+            } else if(received == -1) {
+                if(errno == EINTR) {
+                    continue;
+                } else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    m_disowned = true;
+                }
+
+                break;
+            }
+
+            m_unpacker.buffer_consumed(received);
+
+            msgpack::unpacked unpacked;
+
+            while(m_unpacker.next(&unpacked)) {
+                on_message(unpacked.get());
+            }
+        }
+    }
+
+    send_pending();
+}
+
+void
+engine_t::on_message(const msgpack::object& message) {
+    if(message.type != msgpack::type::ARRAY || message.via.array.size != 2) {
+        throw std::runtime_error("the worker has sent a malformed message");
+    }
+
+    const int id = message.via.array.ptr[0].as<int>();
+    const msgpack::object& args = message.via.array.ptr[1];
+
+    if(id == io::event_traits<io::rpc::handshake>::id) {
+        m_handshaken = true;
+        m_handshake = clock_type::now();
+    } else if(id == io::event_traits<io::rpc::heartbeat>::id) {
+        send<io::rpc::heartbeat>();
+    } else if(id == io::event_traits<io::rpc::terminate>::id) {
+        m_disowned = true;
+    } else if(id == io::event_traits<io::rpc::chunk>::id) {
+        // pass
+    } else if(id == io::event_traits<io::rpc::error>::id) {
+        auto it = m_sessions.find(args.via.array.ptr[0].as<uint64_t>());
+
+        if(it != m_sessions.end()) {
+            it->second.failed = true;
+        }
+    } else if(id == io::event_traits<io::rpc::choke>::id) {
+        auto it = m_sessions.find(args.via.array.ptr[0].as<uint64_t>());
+
+        if(it != m_sessions.end()) {
+            event_t& event = m_events[it->second.event];
+
+            if(it->second.failed) {
+                ++event.errors;
+            } else {
+                ++event.completed;
+            }
+
+            event.latency->record(
+                std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - it->second.start).count()
+            );
+
+            m_sessions.erase(it);
+        }
+    }
+}
+
+void
+engine_t::start_session(clock_type::time_point start) {
+    std::uniform_int_distribution<unsigned> pick(0, m_total_weight - 1);
+
+    unsigned ticket = pick(m_random);
+    size_t index = 0;
+
+    while(ticket >= m_events[index].weight) {
+        ticket -= m_events[index++].weight;
+    }
+
+    event_t& event = m_events[index];
+    const uint64_t session_id = m_next_session++;
+
+    session_t session = { index, start, false };
+    m_sessions[session_id] = session;
+
+    ++event.started;
+
+    send<io::rpc::invoke>(session_id, event.name);
+
+    for(unsigned i = 0; i < event.chunks; ++i) {
+        send_chunk(session_id);
+    }
+
+    send<io::rpc::choke>(session_id);
+}
+
+void
+engine_t::send_pending() {
+    while(m_offset < m_output.bytes.size()) {
+        const ssize_t sent = ::send(
+            m_fd,
+            m_output.bytes.data() + m_offset,
+            m_output.bytes.size() - m_offset,
+            MSG_NOSIGNAL
+        );
+
+        if(sent == -1) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                m_disowned = true;
+            }
+
+            return;
+        }
+
+        m_offset += sent;
+    }
+
+    m_output.bytes.clear();
+    m_offset = 0;
+}
+
+void
+engine_t::report(double elapsed) const {
+    uint64_t total = 0;
+
+    std::printf("%-16s %10s %8s %12s %10s %10s %10s\n", "event", "sessions", "errors", "sessions/s", "p50 us", "p99 us", "p999 us");
+
+    for(auto it = m_events.begin(); it != m_events.end(); ++it) {
+        histogram_t::snapshot_t latency;
+        it->latency->collect(latency);
+
+        const uint64_t done = it->completed + it->errors;
+        total += done;
+
+        std::printf(
+            "%-16s %10llu %8llu %12.1f %10llu %10llu %10llu\n",
+            it->name.c_str(),
+            static_cast<unsigned long long>(done),
+            static_cast<unsigned long long>(it->errors),
+            elapsed > 0.0 ? done / elapsed : 0.0,
+            static_cast<unsigned long long>(latency.quantile(0.5)),
+            static_cast<unsigned long long>(latency.quantile(0.99)),
+            static_cast<unsigned long long>(latency.quantile(0.999))
+        );
+    }
+
+    std::printf("%-16s %10llu %8s %12.1f\n", "total", static_cast<unsigned long long>(total), "", elapsed > 0.0 ? total / elapsed : 0.0);
+}
+
+int
+main(int argc, char *argv[]) {
+    using namespace boost::program_options;
+
+    engine_t::options_t options;
+    std::string mix;
+
+    options_description description("Stand-in engine options");
+    description.add_options()
+        ("help", "show this message")
+        ("endpoint", value<std::string>(&options.endpoint)->default_value("/tmp/grape-engine.sock"), "unix socket to listen on")
+        ("worker", value<std::string>(&options.worker), "worker binary to spawn, otherwise wait for one to connect")
+        ("app", value<std::string>(&options.app)->default_value("app1"), "application name to spawn the worker with")
+        ("worker-arg", value<std::vector<std::string>>(&options.worker_args), "extra argument for the worker, repeatable")
+        ("mix", value<std::string>(&mix)->default_value("event2:1:1"), "events as name[:weight[:chunks]],...")
+        ("chunk-size", value<size_t>(&options.chunk_size)->default_value(64), "size of every chunk in bytes")
+        ("concurrency", value<size_t>(&options.concurrency)->default_value(16), "sessions in flight, closed-loop mode")
+        ("rate", value<double>(&options.rate)->default_value(0.0), "sessions per second, enables open-loop mode")
+        ("max-in-flight", value<size_t>(&options.max_in_flight)->default_value(100000), "open-loop mode cap on sessions in flight")
+        ("duration", value<double>(&options.duration)->default_value(10.0), "seconds to measure for")
+        ("warmup", value<double>(&options.warmup)->default_value(1.0), "seconds of load before measuring");
+
+    variables_map vm;
+
+    try {
+        store(parse_command_line(argc, argv, description), vm);
+        notify(vm);
+
+        if(vm.count("help")) {
+            std::cout << description << std::endl;
+            return EXIT_SUCCESS;
+        }
+
+        options.events = parse_mix(mix);
+
+        if(options.events.empty()) {
+            throw std::runtime_error("the event mix is empty");
+        }
+    } catch(const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    ::signal(SIGPIPE, SIG_IGN);
+
+    try {
+        engine_t engine(options);
+        engine.run();
+    } catch(const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
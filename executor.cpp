@@ -0,0 +1,177 @@
+#include "executor.hpp"
+#include "writer.hpp"
+
+namespace {
+    // Identifies the pool and the deque of the current thread, so tasks
+    // posted from within the pool go to the local deque.
+    thread_local thread_pool_t *current_pool = nullptr;
+    thread_local size_t current_index = 0;
+}
+
+loop_executor_t::loop_executor_t(ev::loop_ref& loop):
+    m_async(loop),
+    m_writer(nullptr)
+{
+    m_async.set<loop_executor_t, &loop_executor_t::on_async>(this);
+    m_async.start();
+}
+
+loop_executor_t::~loop_executor_t() {
+    m_async.stop();
+}
+
+void
+loop_executor_t::post(task_type task) {
+    m_queue.push(std::move(task));
+    m_async.send();
+}
+
+void
+loop_executor_t::on_async(ev::async&, int) {
+    if(m_writer) {
+        scoped_cork_t cork(*m_writer);
+        drain();
+    } else {
+        drain();
+    }
+}
+
+void
+loop_executor_t::drain() {
+    task_type task;
+
+    while(m_queue.pop(task)) {
+        try {
+            task();
+        } catch(...) {
+            // Tasks are expected to handle their own errors.
+        }
+
+        task = nullptr;
+    }
+}
+
+thread_pool_t::thread_pool_t(size_t threads):
+    m_next(0),
+    m_pending(0),
+    m_stopped(false)
+{
+    if(threads == 0) {
+        threads = 1;
+    }
+
+    for(size_t i = 0; i < threads; ++i) {
+        m_queues.emplace_back(new queue_t());
+    }
+
+    for(size_t i = 0; i < threads; ++i) {
+        m_threads.emplace_back(std::bind(&thread_pool_t::run, this, i));
+    }
+}
+
+thread_pool_t::~thread_pool_t() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+
+    m_condition.notify_all();
+
+    for(auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+        it->join();
+    }
+}
+
+void
+thread_pool_t::post(task_type task) {
+    size_t index;
+
+    if(current_pool == this) {
+        index = current_index;
+    } else {
+        index = m_next++ % m_queues.size();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+        m_queues[index]->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_pending;
+    }
+
+    m_condition.notify_one();
+}
+
+bool
+thread_pool_t::pop(size_t index,
+                   task_type& task)
+{
+    {
+        queue_t& own = *m_queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+
+        if(!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for(size_t i = 1; i < m_queues.size(); ++i) {
+        queue_t& victim = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if(!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+thread_pool_t::run(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    task_type task;
+
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while(!m_stopped && m_pending == 0) {
+                m_condition.wait(lock);
+            }
+
+            if(m_stopped) {
+                return;
+            }
+
+            // NOTE: The count works as a semaphore. A task is only counted once
+            // it is in a queue and every thread claims one before looking for
+            // it, so there are always at least as many queued tasks as claims.
+            --m_pending;
+        }
+
+        // The claimed task may have been taken from a queue this thread has
+        // already looked at, by a thread which has claimed a later one, in
+        // which case the later one is somewhere in the queues by now.
+        while(!pop(index, task)) {
+            std::this_thread::yield();
+        }
+
+        try {
+            task();
+        } catch(...) {
+            // Tasks are expected to handle their own errors.
+        }
+
+        task = nullptr;
+    }
+}
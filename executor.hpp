@@ -0,0 +1,182 @@
+#ifndef COCAINE_GRAPE_EXECUTOR
+#define COCAINE_GRAPE_EXECUTOR
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/utility.hpp>
+#include <cocaine/common.hpp>
+
+class writer_t;
+
+class executor_t {
+public:
+    typedef std::function<void()> task_type;
+
+public:
+    virtual
+    ~executor_t() {
+        // pass
+    }
+
+    // Must be safe to call from any thread.
+    virtual
+    void
+    post(task_type task) = 0;
+};
+
+// Unbounded lock-free multiple producer, single consumer queue.
+template<class T>
+class mpsc_queue_t :
+    public boost::noncopyable
+{
+    struct node_t {
+        node_t() :
+            next(nullptr)
+        {
+            // pass
+        }
+
+        std::atomic<node_t*> next;
+        T value;
+    };
+
+public:
+    mpsc_queue_t() :
+        m_head(new node_t()),
+        m_tail(m_head.load())
+    {
+        // pass
+    }
+
+    ~mpsc_queue_t() {
+        T value;
+
+        while (pop(value)) {
+            // pass
+        }
+
+        delete m_tail;
+    }
+
+    void
+    push(T value) {
+        node_t *node = new node_t();
+        node->value = std::move(value);
+
+        node_t *previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    // Must only be called by the consumer.
+    bool
+    pop(T& value) {
+        node_t *tail = m_tail;
+        node_t *next = tail->next.load(std::memory_order_acquire);
+
+        if (!next) {
+            return false;
+        }
+
+        value = std::move(next->value);
+        next->value = T();
+
+        m_tail = next;
+        delete tail;
+
+        return true;
+    }
+
+private:
+    std::atomic<node_t*> m_head;
+    node_t *m_tail;
+};
+
+// Runs tasks posted from any thread on the loop's own thread, the loop is
+// woken up with an ev::async.
+class loop_executor_t :
+    public executor_t,
+    public boost::noncopyable
+{
+public:
+    loop_executor_t(ev::loop_ref& loop);
+
+    ~loop_executor_t();
+
+    void
+    post(task_type task);
+
+    // If set, the writer is kept corked while the tasks of a wakeup run, so
+    // whatever they write leaves with a single flush.
+    void
+    set_writer(writer_t *writer) {
+        m_writer = writer;
+    }
+
+private:
+    void
+    on_async(ev::async&, int);
+
+    void
+    drain();
+
+private:
+    mpsc_queue_t<task_type> m_queue;
+    ev::async m_async;
+    writer_t *m_writer;
+};
+
+// Fixed size pool of threads, each with its own task deque. A thread takes
+// work from the back of its own deque and steals from the front of the others
+// once it runs dry. Tasks posted from outside are spread round robin.
+class thread_pool_t :
+    public executor_t,
+    public boost::noncopyable
+{
+    struct queue_t {
+        std::mutex mutex;
+        std::deque<task_type> tasks;
+    };
+
+public:
+    thread_pool_t(size_t threads);
+
+    // Pending tasks are destroyed without being run.
+    ~thread_pool_t();
+
+    void
+    post(task_type task);
+
+    size_t
+    size() const {
+        return m_threads.size();
+    }
+
+private:
+    void
+    run(size_t index);
+
+    bool
+    pop(size_t index,
+        task_type& task);
+
+private:
+    std::vector<std::unique_ptr<queue_t>> m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::atomic<size_t> m_next;
+
+    // Guards the sleeping threads, m_pending counts queued tasks nobody has
+    // claimed yet.
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    size_t m_pending;
+    bool m_stopped;
+};
+
+#endif // COCAINE_GRAPE_EXECUTOR
@@ -0,0 +1,548 @@
+#ifndef COCAINE_GRAPE_HTTP_REQUEST
+#define COCAINE_GRAPE_HTTP_REQUEST
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "worker.hpp"
+
+// Compares two ASCII strings of the given size ignoring the case, header
+// names being ASCII tokens.
+inline
+bool
+equal_nocase(const char *lhs,
+             const char *rhs,
+             size_t size)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z = _mm_set1_epi8('Z' + 1);
+    const __m128i bit = _mm_set1_epi8(0x20);
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + i));
+
+        // NOTE: Bytes above 0x7F compare as negative and are left alone.
+        x = _mm_or_si128(x, _mm_and_si128(bit,
+            _mm_and_si128(_mm_cmpgt_epi8(x, before_a), _mm_cmplt_epi8(x, after_z))));
+        y = _mm_or_si128(y, _mm_and_si128(bit,
+            _mm_and_si128(_mm_cmpgt_epi8(y, before_a), _mm_cmplt_epi8(y, after_z))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+
+    // Most header names are shorter than a vector, so the rest goes eight
+    // bytes at a time, setting the 0x20 bit of every byte in 'A'..'Z'.
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t high = 0x8080808080808080ULL;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t x, y;
+
+        std::memcpy(&x, lhs + i, 8);
+        std::memcpy(&y, rhs + i, 8);
+
+        const uint64_t xl = x & ~high;
+        const uint64_t yl = y & ~high;
+
+        x |= (((xl + ones * (0x80 - 'A')) & ~(xl + ones * (0x80 - 'Z' - 1)) & ~x & high) >> 2);
+        y |= (((yl + ones * (0x80 - 'A')) & ~(yl + ones * (0x80 - 'Z' - 1)) & ~y & high) >> 2);
+
+        if (x != y) {
+            return false;
+        }
+    }
+
+    for (; i < size; ++i) {
+        char x = lhs[i];
+        char y = rhs[i];
+
+        if (x >= 'A' && x <= 'Z') {
+            x |= 0x20;
+        }
+
+        if (y >= 'A' && y <= 'Z') {
+            y |= 0x20;
+        }
+
+        if (x != y) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The request the cocaine HTTP proxy sends in the first chunk of a session, a
+// [method, uri, version, headers, body] array with the headers being an array
+// of [name, value] pairs. parse() only walks the envelope to find where every
+// field is, nothing is copied or decoded, so the fields are views into the
+// chunk and are valid as long as the chunk is. The headers are indexed on the
+// first access to them.
+class http_request_t {
+public:
+    struct slice_t {
+        slice_t() :
+            data(nullptr),
+            size(0)
+        {
+            // pass
+        }
+
+        std::string
+        str() const {
+            return std::string(data, size);
+        }
+
+        const char *data;
+        size_t size;
+    };
+
+    typedef std::pair<slice_t, slice_t> header_type;
+
+public:
+    http_request_t() :
+        m_indexed(false)
+    {
+        // pass
+    }
+
+    // Returns false if the envelope isn't complete yet, throws if it is
+    // malformed or followed by anything.
+    bool
+    parse(const char *data,
+          size_t size)
+    {
+        reader_t reader = { data, data + size };
+        item_t item;
+
+        if (!reader.next(item)) {
+            return false;
+        }
+
+        if (item.type != item_t::array || item.length != 5) {
+            throw cocaine::error_t("the request is not an HTTP request");
+        }
+
+        if (!reader.raw(m_method) || !reader.raw(m_uri) || !reader.raw(m_version)) {
+            return false;
+        }
+
+        m_headers.data = reader.position;
+
+        if (!reader.skip()) {
+            return false;
+        }
+
+        m_headers.size = reader.position - m_headers.data;
+
+        if (!reader.raw(m_body)) {
+            return false;
+        }
+
+        if (reader.position != reader.end) {
+            throw cocaine::error_t("unexpected input after the request");
+        }
+
+        m_index.clear();
+        m_indexed = false;
+
+        return true;
+    }
+
+    const slice_t&
+    method() const {
+        return m_method;
+    }
+
+    const slice_t&
+    uri() const {
+        return m_uri;
+    }
+
+    const slice_t&
+    version() const {
+        return m_version;
+    }
+
+    const slice_t&
+    body() const {
+        return m_body;
+    }
+
+    const std::vector<header_type>&
+    headers() const {
+        if (!m_indexed) {
+            index();
+        }
+
+        return m_index;
+    }
+
+    // The value of the first header with this name, null if there is none.
+    const slice_t*
+    header(const char *name,
+           size_t size) const
+    {
+        const std::vector<header_type>& index = headers();
+
+        for (auto it = index.begin(); it != index.end(); ++it) {
+            if (it->first.size == size && equal_nocase(it->first.data, name, size)) {
+                return &it->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    const slice_t*
+    header(const std::string& name) const {
+        return header(name.data(), name.size());
+    }
+
+private:
+    struct item_t {
+        enum type_t {
+            scalar,
+            raw,
+            array,
+            map
+        };
+
+        type_t type;
+
+        // Bytes of a raw, elements of an array or a map.
+        uint64_t length;
+
+        const char *data;
+    };
+
+    // Just enough of msgpack to find the objects in a buffer. Every method
+    // returns false when the buffer ends before the object does.
+    struct reader_t {
+        static
+        uint64_t
+        load(const char *data,
+             size_t size)
+        {
+            uint64_t value = 0;
+
+            for (size_t i = 0; i < size; ++i) {
+                value = (value << 8) | static_cast<unsigned char>(data[i]);
+            }
+
+            return value;
+        }
+
+        // Reads the header of the next object, and the payload of a scalar
+        // or a raw.
+        bool
+        next(item_t& item) {
+            if (position == end) {
+                return false;
+            }
+
+            const unsigned char tag = static_cast<unsigned char>(*position);
+
+            size_t header = 1;
+            size_t length_size = 0;
+            size_t extra = 0;
+
+            item.type = item_t::scalar;
+            item.length = 0;
+
+            if (tag <= 0x7F || tag >= 0xE0) {
+                // Fixed integers.
+            } else if (tag <= 0x8F) {
+                item.type = item_t::map;
+                item.length = tag & 0x0F;
+            } else if (tag <= 0x9F) {
+                item.type = item_t::array;
+                item.length = tag & 0x0F;
+            } else if (tag <= 0xBF) {
+                item.type = item_t::raw;
+                item.length = tag & 0x1F;
+            } else {
+                switch (tag) {
+                    case 0xC0: case 0xC2: case 0xC3:
+                        break;
+                    case 0xC4: case 0xD9:
+                        item.type = item_t::raw;
+                        length_size = 1;
+                        break;
+                    case 0xC5: case 0xDA:
+                        item.type = item_t::raw;
+                        length_size = 2;
+                        break;
+                    case 0xC6: case 0xDB:
+                        item.type = item_t::raw;
+                        length_size = 4;
+                        break;
+                    case 0xC7: case 0xC8: case 0xC9:
+                        // Extensions are skipped as raws with a type byte.
+                        item.type = item_t::raw;
+                        length_size = 1 << (tag - 0xC7);
+                        extra = 1;
+                        break;
+                    case 0xCA: case 0xCE: case 0xD2:
+                        header += 4;
+                        break;
+                    case 0xCB: case 0xCF: case 0xD3:
+                        header += 8;
+                        break;
+                    case 0xCC: case 0xD0:
+                        header += 1;
+                        break;
+                    case 0xCD: case 0xD1:
+                        header += 2;
+                        break;
+                    case 0xD4: case 0xD5: case 0xD6: case 0xD7: case 0xD8:
+                        header += 1 + (1 << (tag - 0xD4));
+                        break;
+                    case 0xDC:
+                        item.type = item_t::array;
+                        length_size = 2;
+                        break;
+                    case 0xDD:
+                        item.type = item_t::array;
+                        length_size = 4;
+                        break;
+                    case 0xDE:
+                        item.type = item_t::map;
+                        length_size = 2;
+                        break;
+                    case 0xDF:
+                        item.type = item_t::map;
+                        length_size = 4;
+                        break;
+                    default:
+                        throw cocaine::error_t("the request is not valid msgpack");
+                }
+            }
+
+            if (remaining() < header + length_size + extra) {
+                return false;
+            }
+
+            if (length_size) {
+                item.length = load(position + 1, length_size);
+            }
+
+            header += length_size + extra;
+
+            if (item.type == item_t::raw) {
+                if (remaining() - header < item.length) {
+                    return false;
+                }
+
+                item.data = position + header;
+                position += header + item.length;
+            } else {
+                item.data = position;
+                position += header;
+            }
+
+            return true;
+        }
+
+        // Skips the next object with everything nested in it.
+        bool
+        skip() {
+            uint64_t pending = 1;
+            item_t item;
+
+            while (pending) {
+                if (!next(item)) {
+                    return false;
+                }
+
+                --pending;
+
+                if (item.type == item_t::array) {
+                    pending += item.length;
+                } else if (item.type == item_t::map) {
+                    pending += item.length * 2;
+                }
+            }
+
+            return true;
+        }
+
+        bool
+        raw(slice_t& slice) {
+            item_t item;
+
+            if (!next(item)) {
+                return false;
+            }
+
+            if (item.type != item_t::raw) {
+                throw cocaine::error_t("the request is not an HTTP request");
+            }
+
+            slice.data = item.data;
+            slice.size = item.length;
+
+            return true;
+        }
+
+        size_t
+        remaining() const {
+            return end - position;
+        }
+
+        const char *position;
+        const char *end;
+    };
+
+    void
+    index() const {
+        reader_t reader = { m_headers.data, m_headers.data + m_headers.size };
+        item_t item;
+
+        if (!reader.next(item) || item.type != item_t::array) {
+            throw cocaine::error_t("the request headers are malformed");
+        }
+
+        m_index.reserve(item.length);
+
+        for (uint64_t i = 0; i < item.length; ++i) {
+            header_type header;
+            item_t pair;
+
+            if (!reader.next(pair) || pair.type != item_t::array || pair.length != 2) {
+                throw cocaine::error_t("the request headers are malformed");
+            }
+
+            reader.raw(header.first);
+            reader.raw(header.second);
+
+            m_index.push_back(header);
+        }
+
+        m_indexed = true;
+    }
+
+private:
+    slice_t m_method;
+    slice_t m_uri;
+    slice_t m_version;
+    slice_t m_body;
+
+    // The whole encoded headers object.
+    slice_t m_headers;
+
+    mutable std::vector<header_type> m_index;
+    mutable bool m_indexed;
+};
+
+// A handler of requests coming from the HTTP proxy, which gets the parsed
+// request in on_request(). A request coming in one chunk is parsed right in
+// the receive buffer; only a request split between chunks is copied. Either
+// way the request is only valid until on_request() returns.
+template<class AppT>
+class http_handler_t :
+    public handler_t<AppT>
+{
+public:
+    http_handler_t(AppT& a) :
+        handler_t<AppT>(a),
+        m_handled(false)
+    {
+        // pass
+    }
+
+    void
+    invoke(const std::string& /* event */,
+           std::shared_ptr<response_stream_t> response)
+    {
+        m_response = response;
+    }
+
+    void
+    write(const char *chunk,
+          size_t size)
+    {
+        if (m_handled) {
+            throw cocaine::error_t("unexpected input after the request");
+        }
+
+        if (m_input.empty() && handle(chunk, size)) {
+            return;
+        }
+
+        this->retain(chunk, size, m_input);
+
+        if (handle(m_input.data(), m_input.size())) {
+            m_input.clear();
+        }
+    }
+
+    void
+    close() {
+        if (!m_handled) {
+            throw cocaine::error_t("the request is incomplete");
+        }
+    }
+
+    void
+    error(cocaine::error_code code,
+          const std::string& message)
+    {
+        // pass
+    }
+
+    void
+    reset() {
+        m_handled = false;
+        m_input.clear();
+        m_response.reset();
+    }
+
+protected:
+    virtual
+    void
+    on_request(const http_request_t& request,
+               std::shared_ptr<response_stream_t> response) = 0;
+
+private:
+    bool
+    handle(const char *data,
+           size_t size)
+    {
+        http_request_t request;
+
+        if (!request.parse(data, size)) {
+            return false;
+        }
+
+        m_handled = true;
+
+        on_request(request, m_response);
+
+        return true;
+    }
+
+private:
+    bool m_handled;
+
+    // Only used when the request is split between chunks.
+    std::string m_input;
+
+    std::shared_ptr<response_stream_t> m_response;
+};
+
+#endif // COCAINE_GRAPE_HTTP_REQUEST
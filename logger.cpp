@@ -20,9 +20,15 @@
 
 #include "logger.hpp"
 
+#include <cerrno>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cocaine/asio/service.hpp>
 #include <cocaine/asio/socket.hpp>
 #include <cocaine/asio/tcp.hpp>
-#include <cocaine/asio/writable_stream.hpp>
+#include <cocaine/messages.hpp>
 
 #include <cocaine/essentials/services/logging.hpp>
 
@@ -30,25 +36,468 @@ using namespace cocaine;
 using namespace cocaine::io;
 using namespace cocaine::logger;
 
+namespace {
+    struct buffer_t {
+        buffer_t(std::vector<char>& bytes):
+            bytes(bytes)
+        {
+            // pass
+        }
+
+        void
+        write(const char *data,
+              size_t size)
+        {
+            bytes.insert(bytes.end(), data, data + size);
+        }
+
+        std::vector<char>& bytes;
+    };
+
+    void
+    pack_record(msgpack::packer<buffer_t>& packer,
+                cocaine::logging::priorities priority,
+                const char *source,
+                size_t source_size,
+                const char *message,
+                size_t message_size)
+    {
+        packer.pack_array(2);
+        packer.pack(static_cast<int>(event_traits<io::logging::emit>::id));
+        packer.pack_array(3);
+        packer.pack(static_cast<int>(priority));
+        packer.pack_raw(source_size);
+        packer.pack_raw_body(source, source_size);
+        packer.pack_raw(message_size);
+        packer.pack_raw_body(message, message_size);
+    }
+}
+
+record_ring_t::record_ring_t(size_t capacity,
+                             size_t record_size):
+    m_mask(capacity - 1),
+    m_record_size(record_size),
+    m_cells(new cell_t[capacity]),
+    m_data(new char[capacity * record_size]),
+    m_tail(0),
+    m_head(0)
+{
+    if(capacity < 2 || (capacity & m_mask) != 0) {
+        throw cocaine::error_t("the log ring size must be a power of two");
+    }
+
+    for(size_t i = 0; i < capacity; ++i) {
+        m_cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool
+record_ring_t::push(cocaine::logging::priorities priority,
+                    const std::string& source,
+                    const std::string& message)
+{
+    size_t position = m_tail.load(std::memory_order_relaxed);
+    cell_t *cell;
+
+    while(true) {
+        cell = &m_cells[position & m_mask];
+
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t delta = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+
+        if(delta == 0) {
+            if(m_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(delta < 0) {
+            return false;
+        } else {
+            position = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    char *data = m_data.get() + (position & m_mask) * m_record_size;
+
+    cell->priority = priority;
+    cell->source = std::min(source.size(), m_record_size);
+    cell->message = std::min(message.size(), m_record_size - cell->source);
+
+    std::memcpy(data, source.data(), cell->source);
+    std::memcpy(data + cell->source, message.data(), cell->message);
+
+    cell->sequence.store(position + 1, std::memory_order_release);
+
+    return true;
+}
+
 remote_t::remote_t(const std::string& name,
                    const Json::Value& args,
-                   service_t& service)
+                   service_t& service):
+    m_connected(false),
+    m_ring(
+        args.get("ring-size", 4096).asUInt(),
+        args.get("record-size", 512).asUInt()
+    ),
+    m_policy(
+        args.get("policy", std::string("drop-oldest")).asString() == "drop-newest" ?
+            overflow_policy_t::drop_newest
+          : overflow_policy_t::drop_oldest
+    ),
+    m_batch_size(args.get("batch-size", 64).asUInt()),
+    m_interval(args.get("flush-interval", 0.1).asDouble()),
+    m_pending(false),
+    m_dropped(0),
+    m_verbosity(cocaine::logging::debug),
+    m_reported(0),
+    m_offset(0),
+    m_records(0),
+    m_timer(service.loop()),
+    m_async(service.loop()),
+    m_watcher(service.loop()),
+    m_refresh(service.loop()),
+    m_reader(service.loop())
 {
-    auto socket_ = std::make_shared<io::socket<tcp>>(tcp::endpoint("127.0.0.1", 12501));
+    m_timer.set<remote_t, &remote_t::on_timer>(this);
 
-    m_encoder.attach(
-        std::make_shared<writable_stream<io::socket<tcp>>>(service, socket_)
-    );
+    m_async.set<remote_t, &remote_t::on_async>(this);
+    m_async.start();
+
+    m_watcher.set<remote_t, &remote_t::on_event>(this);
+
+    m_reader.set<remote_t, &remote_t::on_read>(this);
+
+    const double refresh = args.get("verbosity-refresh", 30.0).asDouble();
+
+    m_refresh.set<remote_t, &remote_t::on_refresh>(this);
+    m_refresh.set(refresh, refresh);
+}
+
+remote_t::~remote_t() {
+    m_timer.stop();
+    m_async.stop();
+    m_watcher.stop();
+    m_refresh.stop();
+    m_reader.stop();
+
+    // NOTE: Ship whatever is left, as long as the socket takes it right away.
+    flush();
 }
 
 void
-remote_t::emit(logging::priorities priority,
+remote_t::connect() {
+    if(!m_refresh.is_active()) {
+        m_refresh.start();
+    }
+
+    if(m_socket) {
+        return;
+    }
+
+    const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(fd == -1) {
+        return;
+    }
+
+    m_socket = std::make_shared<io::socket<tcp>>(fd);
+
+    sockaddr_in address;
+
+    std::memset(&address, 0, sizeof(address));
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(12501);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+        on_connect();
+    } else if(errno == EINPROGRESS) {
+        m_watcher.start(fd, ev::WRITE);
+    } else {
+        disconnect();
+    }
+}
+
+void
+remote_t::emit(cocaine::logging::priorities priority,
                const std::string& source,
                const std::string& message)
 {
-    m_encoder.write<io::logging::emit>(
-        static_cast<int>(priority),
-        source,
-        message
+    if(!m_ring.push(priority, source, message)) {
+        // NOTE: Dropping the oldest record might race with other producers or
+        // with the flush, in which case the newest one is dropped after all.
+        if(m_policy == overflow_policy_t::drop_newest ||
+           !m_ring.pop([](cocaine::logging::priorities, const char*, size_t, const char*, size_t) { }) ||
+           !m_ring.push(priority, source, message))
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if(m_ring.size() >= m_batch_size) {
+        m_async.send();
+    } else if(!m_pending.load(std::memory_order_relaxed) && !m_pending.exchange(true)) {
+        m_async.send();
+    }
+}
+
+void
+remote_t::on_timer(ev::timer&, int) {
+    flush();
+    arm();
+}
+
+void
+remote_t::on_async(ev::async&, int) {
+    if(m_ring.size() >= m_batch_size) {
+        flush();
+        arm();
+    } else if(!m_timer.is_active()) {
+        m_timer.start(m_interval, 0.0);
+    }
+}
+
+void
+remote_t::on_event(ev::io&, int) {
+    m_watcher.stop();
+
+    if(!m_connected) {
+        int error = 0;
+        socklen_t size = sizeof(error);
+
+        if(::getsockopt(m_socket->fd(), SOL_SOCKET, SO_ERROR, &error, &size) != 0 || error != 0) {
+            disconnect();
+        } else {
+            on_connect();
+        }
+
+        return;
+    }
+
+    send();
+
+    if(!m_watcher.is_active()) {
+        flush();
+        arm();
+    }
+}
+
+void
+remote_t::on_refresh(ev::timer&, int) {
+    if(m_connected) {
+        request_verbosity();
+    } else {
+        connect();
+    }
+}
+
+void
+remote_t::on_read(ev::io&, int) {
+    m_unpacker->reserve_buffer(4096);
+
+    ssize_t received = ::recv(
+        m_socket->fd(),
+        m_unpacker->buffer(),
+        m_unpacker->buffer_capacity(),
+        MSG_DONTWAIT
     );
+
+    if(received == -1) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            disconnect();
+        }
+
+        return;
+    } else if(received == 0) {
+        // NOTE: The service has gone away, stick to the last known verbosity
+        // until it's back.
+        disconnect();
+        return;
+    }
+
+    m_unpacker->buffer_consumed(received);
+
+    msgpack::unpacked unpacked;
+
+    try {
+        while(m_unpacker->next(&unpacked)) {
+            on_reply(unpacked.get());
+        }
+    } catch(const msgpack::unpack_error&) {
+        disconnect();
+    }
+}
+
+void
+remote_t::on_reply(const msgpack::object& reply) {
+    // NOTE: The service answers a verbosity request with an rpc::chunk, i.e.
+    // [chunk, [tag, payload]], the payload being the msgpack encoded level,
+    // followed by an rpc::choke. Nothing else is expected on this connection.
+    if(reply.type != msgpack::type::ARRAY || reply.via.array.size != 2) {
+        return;
+    }
+
+    const msgpack::object& id = reply.via.array.ptr[0];
+    const msgpack::object& args = reply.via.array.ptr[1];
+
+    if(id.type != msgpack::type::POSITIVE_INTEGER ||
+       id.via.u64 != static_cast<uint64_t>(event_traits<io::rpc::chunk>::id) ||
+       args.type != msgpack::type::ARRAY ||
+       args.via.array.size != 2 ||
+       args.via.array.ptr[1].type != msgpack::type::RAW)
+    {
+        return;
+    }
+
+    const msgpack::object_raw& payload = args.via.array.ptr[1].via.raw;
+
+    msgpack::zone zone;
+    msgpack::object level;
+    size_t offset = 0;
+
+    if(msgpack::unpack(payload.ptr, payload.size, &offset, &zone, &level) != msgpack::UNPACK_SUCCESS) {
+        return;
+    }
+
+    if(level.type == msgpack::type::POSITIVE_INTEGER && level.via.u64 <= static_cast<uint64_t>(cocaine::logging::debug)) {
+        m_verbosity.store(static_cast<int>(level.via.u64), std::memory_order_relaxed);
+    }
+}
+
+void
+remote_t::on_connect() {
+    m_connected = true;
+    m_unpacker.reset(new msgpack::unpacker());
+    m_reader.start(m_socket->fd(), ev::READ);
+
+    request_verbosity();
+    flush();
+    arm();
+}
+
+void
+remote_t::disconnect() {
+    m_watcher.stop();
+    m_reader.stop();
+
+    m_socket.reset();
+    m_connected = false;
+
+    // NOTE: Whatever is in the ring stays there until the next connection.
+    m_dropped.fetch_add(m_records, std::memory_order_relaxed);
+
+    m_buffer.clear();
+    m_offset = 0;
+    m_records = 0;
+}
+
+void
+remote_t::arm() {
+    // NOTE: While the socket is down or congested, the records wait for the
+    // connection or for the socket to drain, which flush them anyway.
+    if(!m_connected || m_watcher.is_active()) {
+        return;
+    }
+
+    // NOTE: The flag is cleared before the ring is checked, so a record which
+    // comes in between is either seen here or wakes the loop up itself.
+    m_pending.store(false);
+
+    if(m_ring.size() != 0) {
+        m_pending.store(true);
+
+        if(!m_timer.is_active()) {
+            m_timer.start(m_interval, 0.0);
+        }
+    }
+}
+
+void
+remote_t::request_verbosity() {
+    buffer_t buffer(m_buffer);
+    msgpack::packer<buffer_t> packer(buffer);
+
+    packer.pack_array(2);
+    packer.pack(static_cast<int>(event_traits<io::logging::verbosity>::id));
+    packer.pack_array(0);
+
+    // NOTE: If the socket is congested, the request leaves with the backlog.
+    if(!m_watcher.is_active()) {
+        send();
+    }
+}
+
+void
+remote_t::flush() {
+    // NOTE: Nothing is encoded while the socket is down or congested, so the
+    // backlog is bounded by the ring and the overflow policy takes care of
+    // the rest.
+    if(!m_connected || m_watcher.is_active()) {
+        return;
+    }
+
+    buffer_t buffer(m_buffer);
+    msgpack::packer<buffer_t> packer(buffer);
+
+    const uint64_t dropped = m_dropped.load(std::memory_order_relaxed);
+
+    if(dropped != m_reported) {
+        const std::string source("logger");
+        const std::string message(cocaine::format("dropped %d log records", dropped - m_reported));
+
+        pack_record(packer, cocaine::logging::warning, source.data(), source.size(), message.data(), message.size());
+
+        m_reported = dropped;
+    }
+
+    auto encode = [&](cocaine::logging::priorities priority,
+                      const char *source,
+                      size_t source_size,
+                      const char *message,
+                      size_t message_size)
+    {
+        pack_record(packer, priority, source, source_size, message, message_size);
+        ++m_records;
+    };
+
+    while(m_ring.pop(encode)) {
+        // pass
+    }
+
+    send();
+}
+
+void
+remote_t::send() {
+    while(m_offset < m_buffer.size()) {
+        ssize_t sent = ::send(
+            m_socket->fd(),
+            m_buffer.data() + m_offset,
+            m_buffer.size() - m_offset,
+            MSG_NOSIGNAL | MSG_DONTWAIT
+        );
+
+        if(sent == -1) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                m_watcher.start(m_socket->fd(), ev::WRITE);
+                return;
+            }
+
+            // NOTE: There's nowhere to report the failure to, so the batch is
+            // counted as lost and the connection is retried later.
+            disconnect();
+            return;
+        }
+
+        m_offset += sent;
+    }
+
+    m_buffer.clear();
+    m_offset = 0;
+    m_records = 0;
 }
@@ -21,25 +21,44 @@
 #ifndef COCAINE_REMOTE_LOGGER_HPP
 #define COCAINE_REMOTE_LOGGER_HPP
 
-#include <cocaine/rpc/encoder.hpp>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
 #include <cocaine/common.hpp>
+#include <msgpack.hpp>
 #include <cocaine/json.hpp>
 #include <cocaine/format.hpp>
 
+// Log statements below this level compile to nothing, arguments included:
+// the level is checked first and is a constant, so the statement is folded
+// away and its arguments are never evaluated. One of logging::priorities,
+// defaults to debug, i.e. everything is compiled in and only the runtime
+// verbosity applies. Release builds may pass e.g. -DCOCAINE_LOG_MIN_LEVEL=info
+// to strip the debug statements.
+#ifndef COCAINE_LOG_MIN_LEVEL
+    #define COCAINE_LOG_MIN_LEVEL debug
+#endif
+
 #define COCAINE_LOG(log, level, ...) \
-    if(log->verbosity() >= level) log->emit(level, __VA_ARGS__);
+    do { \
+        if(level <= cocaine::logging::COCAINE_LOG_MIN_LEVEL && log->verbosity() >= level) \
+            log->emit(level, __VA_ARGS__); \
+    } while(false)
 
 #define COCAINE_LOG_DEBUG(log, ...) \
-    COCAINE_LOG(log, logging::debug, __VA_ARGS__)
+    COCAINE_LOG(log, cocaine::logging::debug, __VA_ARGS__)
 
 #define COCAINE_LOG_INFO(log, ...) \
-    COCAINE_LOG(log, logging::info, __VA_ARGS__)
+    COCAINE_LOG(log, cocaine::logging::info, __VA_ARGS__)
 
 #define COCAINE_LOG_WARNING(log, ...) \
-    COCAINE_LOG(log, logging::warning, __VA_ARGS__)
+    COCAINE_LOG(log, cocaine::logging::warning, __VA_ARGS__)
 
 #define COCAINE_LOG_ERROR(log, ...) \
-    COCAINE_LOG(log, logging::error, __VA_ARGS__)
+    COCAINE_LOG(log, cocaine::logging::error, __VA_ARGS__)
 
 namespace cocaine { namespace logger {
 
@@ -97,18 +116,132 @@ private:
     const std::string m_source;
 };
 
+// Bounded lock-free ring of log records, with every record formatted into a
+// preallocated fixed-size slot. Any thread may push and pop, records which
+// don't fit into a slot are truncated.
+class record_ring_t:
+    public boost::noncopyable
+{
+    struct cell_t {
+        std::atomic<size_t> sequence;
+        logging::priorities priority;
+        size_t source;
+        size_t message;
+    };
+
+public:
+    record_ring_t(size_t capacity,
+                  size_t record_size);
+
+    // Returns false if the ring is full.
+    bool
+    push(logging::priorities priority,
+         const std::string& source,
+         const std::string& message);
+
+    // Passes the oldest record to the handler as (priority, source, source
+    // size, message, message size). Returns false if the ring is empty.
+    template<class F>
+    bool
+    pop(F handler);
+
+    // Approximate number of records in the ring.
+    size_t
+    size() const {
+        return m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_relaxed);
+    }
+
+private:
+    const size_t m_mask;
+    const size_t m_record_size;
+
+    std::unique_ptr<cell_t[]> m_cells;
+    std::unique_ptr<char[]> m_data;
+
+    // NOTE: Producers and consumers contend on different cache lines.
+    char m_padding_tail[64];
+    std::atomic<size_t> m_tail;
+    char m_padding_head[64];
+    std::atomic<size_t> m_head;
+};
+
+template<class F>
+bool
+record_ring_t::pop(F handler) {
+    size_t position = m_head.load(std::memory_order_relaxed);
+    cell_t *cell;
+
+    while(true) {
+        cell = &m_cells[position & m_mask];
+
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t delta = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+
+        if(delta == 0) {
+            if(m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(delta < 0) {
+            return false;
+        } else {
+            position = m_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    const char *data = m_data.get() + (position & m_mask) * m_record_size;
+
+    handler(cell->priority, data, cell->source, data + cell->source, cell->message);
+
+    cell->sequence.store(position + m_mask + 1, std::memory_order_release);
+
+    return true;
+}
+
+// Logger backend for the cocaine logging service. Records are put into a ring
+// and shipped from the event loop in batches, either a flush interval after
+// the first of them or as soon as enough of them pile up, so emit() never
+// blocks and never does I/O, and an idle logger doesn't wake the loop. When
+// the service can't keep up, the ring overflows and records are dropped,
+// either the newest or the oldest ones depending on the policy.
+//
+// Nothing touches the network until connect(), which starts a non-blocking
+// connect and returns. Records emitted in the meantime wait in the ring. The
+// verbosity is asked from the service as soon as the connection is up, then
+// periodically; everything is emitted until the first answer arrives. A lost
+// connection is re-established on the same schedule.
+//
+// Configuration, all optional:
+//   "ring-size": number of record slots, a power of two, defaults to 4096.
+//   "record-size": size of a record slot in bytes, defaults to 512.
+//   "batch-size": number of records which triggers a flush, defaults to 64.
+//   "flush-interval": seconds a record waits for the batch, defaults to 0.1.
+//   "policy": either "drop-newest" or "drop-oldest", defaults to the latter.
+//   "verbosity-refresh": seconds between verbosity requests, defaults to 30.
 class remote_t:
     public logger_t
 {
+public:
+    enum class overflow_policy_t: int {
+        drop_newest,
+        drop_oldest
+    };
+
 public:
     remote_t(const std::string& name,
              const Json::Value& args,
              io::service_t& service);
 
+    virtual
+    ~remote_t();
+
+    // Connects to the service in the background.
+    void
+    connect();
+
     virtual
     logging::priorities
     verbosity() const {
-        return logging::priorities::debug;
+        return static_cast<logging::priorities>(m_verbosity.load(std::memory_order_relaxed));
     }
 
     virtual
@@ -117,8 +250,87 @@ public:
          const std::string& source,
          const std::string& message);
 
+    // Number of records lost so far, either to overflows or to I/O errors.
+    uint64_t
+    dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    void
+    on_timer(ev::timer&, int);
+
+    void
+    on_async(ev::async&, int);
+
+    void
+    on_event(ev::io&, int);
+
+    void
+    on_refresh(ev::timer&, int);
+
+    void
+    on_read(ev::io&, int);
+
+    void
+    on_reply(const msgpack::object& reply);
+
+    void
+    on_connect();
+
+    void
+    disconnect();
+
+    // Schedules the next flush if there is anything left to flush, called
+    // once the ring has been flushed.
+    void
+    arm();
+
+    void
+    request_verbosity();
+
+    // Encodes all the pending records and sends them.
+    void
+    flush();
+
+    void
+    send();
+
 private:
-    io::encoder<io::writable_stream<io::socket<io::tcp>>> m_encoder;
+    // Null while disconnected, m_connected is only set once the connection
+    // is established.
+    std::shared_ptr<io::socket<io::tcp>> m_socket;
+    bool m_connected;
+
+    record_ring_t m_ring;
+    const overflow_policy_t m_policy;
+    const size_t m_batch_size;
+    const double m_interval;
+
+    // Set while a flush is due, so that emit() wakes up the loop only for the
+    // first record of a batch.
+    std::atomic<bool> m_pending;
+
+    std::atomic<uint64_t> m_dropped;
+
+    // The verbosity last reported by the service.
+    std::atomic<int> m_verbosity;
+
+    // The dropped records counter as of the last report to the service.
+    uint64_t m_reported;
+
+    // Encoded records not yet accepted by the socket, and the number of them.
+    std::vector<char> m_buffer;
+    size_t m_offset;
+    size_t m_records;
+
+    ev::timer m_timer;
+    ev::async m_async;
+    ev::io m_watcher;
+
+    std::unique_ptr<msgpack::unpacker> m_unpacker;
+    ev::timer m_refresh;
+    ev::io m_reader;
 };
 
 }} // namespace cocaine::logger
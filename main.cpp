@@ -1,4 +1,8 @@
 #include "worker.hpp"
+#include "coroutine.hpp"
+#include "http_request.hpp"
+#include "response_template.hpp"
+#include "typed_handler.hpp"
 #include <iostream>
 #include <memory>
 #include <string>
@@ -25,7 +29,7 @@ class App1 :
 
         void
         invoke(const std::string& event,
-               std::shared_ptr<cocaine::api::stream_t> response)
+               std::shared_ptr<response_stream_t> response)
         {
             m_state = 1;
             m_response = response;
@@ -36,19 +40,7 @@ class App1 :
         write(const char *chunk,
              size_t size)
         {
-            msgpack::sbuffer buffer;
-            msgpack::packer<msgpack::sbuffer> pk(&buffer);
-            pk.pack_map(2);
-            pk.pack(std::string("code"));
-            pk.pack(200);
-
-            std::vector<std::pair<std::string, std::string>> headers;
-            headers.push_back(std::make_pair(std::string("Content-Type"), std::string("text/plain")));
-
-            pk.pack(std::string("headers"));
-            pk.pack(headers);
-
-            m_response->write(buffer.data(), buffer.size());
+            app.m_text_ok.write(*m_response);
 
             std::string msg = "jvbherjhvhejrhbgvehjrbgvhjerbvgherbvgherb";
             byte abd[CryptoPP::SHA512::DIGESTSIZE];
@@ -56,8 +48,10 @@ class App1 :
 
             std::string body = "<html><body>" + m_event_name + "</body></html>";
 
-            msgpack::pack(buffer, body);
-            m_response->write(buffer.data(), buffer.size());
+            response_stream_t::chunk_t reply(m_response->begin_chunk());
+            msgpack::packer<chunk_writer_t> packer(reply.writer());
+            packer.pack(body);
+            reply.commit();
             m_response->close();
         }
 
@@ -72,9 +66,16 @@ class App1 :
         {
             // pass
         }
+
+        void
+        reset() {
+            m_state = 0;
+            m_response.reset();
+            m_event_name.clear();
+        }
     private:
         int m_state;
-        std::shared_ptr<cocaine::api::stream_t> m_response;
+        std::shared_ptr<response_stream_t> m_response;
         std::string m_event_name;
     };
 
@@ -91,7 +92,7 @@ class App1 :
 
         void
         invoke(const std::string& event,
-               std::shared_ptr<cocaine::api::stream_t> response)
+               std::shared_ptr<response_stream_t> response)
         {
             m_state = 1;
             m_response = response;
@@ -121,13 +122,77 @@ class App1 :
         std::shared_ptr<cocaine::api::stream_t> m_response;
     };
 
+    class on_http :
+        public http_handler_t<App1>
+    {
+    public:
+        on_http(App1& a) :
+            http_handler_t<App1>(a)
+        {
+            // pass
+        }
+
+    protected:
+        void
+        on_request(const http_request_t& request,
+                   std::shared_ptr<response_stream_t> response)
+        {
+            app.m_text_ok.write(*response);
+
+            response_stream_t::chunk_t chunk(response->begin_chunk());
+            msgpack::packer<chunk_writer_t> packer(chunk.writer());
+            packer.pack_raw(request.uri().size);
+            packer.pack_raw_body(request.uri().data, request.uri().size);
+            chunk.commit();
+            response->close();
+        }
+    };
+
+#ifdef COCAINE_GRAPE_HAVE_COROUTINES
+    class on_echo :
+        public coroutine_handler_t<App1>
+    {
+    public:
+        on_echo(App1& a) :
+            coroutine_handler_t<App1>(a)
+        {
+            // pass
+        }
+
+    protected:
+        void
+        run() {
+            const char *chunk;
+            size_t size;
+
+            while(wait_writable() && read(chunk, size)) {
+                response()->write(chunk, size);
+            }
+
+            if(!failed()) {
+                response()->close();
+            }
+        }
+    };
+#endif
+
 public:
-    App1()
+    App1() :
+        m_text_ok(200, { response_template_t::header_type("Content-Type", "text/plain") })
     {
-        on<on_event1>("event1");
+        on<on_event1, pooled_factory_t>("event1");
+        offload("event1");
         // on("event2", method_factory(&App1::on_event2, this));
-        on("event2", method_factory_t<App1>(&App1::on_event2));
+        on("event2", method_factory_t<App1>(&App1::on_event2, 1024));
+        memoize("event2", 16 << 20, 60.0);
         on<on_exit>("exit");
+        on<on_http, pooled_factory_t>("http");
+#ifdef COCAINE_GRAPE_HAVE_COROUTINES
+        on<on_echo>("echo");
+#endif
+        on("length", streaming_method_factory_t<App1, size_t>(&App1::on_length_chunk, &App1::on_length_close));
+        deadline("length", 30.0, 600.0);
+        on<std::vector<int64_t>, int64_t>("sum", &App1::on_sum, 1024);
     }
 
     std::string on_event2(const std::string& event,
@@ -135,6 +200,32 @@ public:
     {
         return "on_event2:" + event;
     }
+
+    void on_length_chunk(size_t& length,
+                         const char *chunk,
+                         size_t size)
+    {
+        length += size;
+    }
+
+    std::string on_length_close(size_t& length,
+                                const std::string& event)
+    {
+        return std::to_string(length);
+    }
+
+    int64_t on_sum(const std::vector<int64_t>& numbers) {
+        int64_t sum = 0;
+
+        for(size_t i = 0; i < numbers.size(); ++i) {
+            sum += numbers[i];
+        }
+
+        return sum;
+    }
+
+private:
+    const response_template_t m_text_ok;
 };
 
 std::shared_ptr<worker_t>
@@ -148,7 +239,10 @@ make_worker(int argc,
     options_description options;
     options.add_options()
         ("app", value<std::string>())
-        ("uuid", value<std::string>());
+        ("uuid", value<std::string>())
+        ("endpoint", value<std::string>()->default_value(""))
+        ("reactors", value<size_t>()->default_value(0))
+        ("batch-limit", value<size_t>()->default_value(0));
 
     try {
         command_line_parser parser(argc, argv);
@@ -162,8 +256,14 @@ make_worker(int argc,
     }
 
     try {
-        return std::make_shared<worker_t>(vm["app"].as<std::string>(),
-                                          vm["uuid"].as<std::string>());
+        auto worker = std::make_shared<worker_t>(vm["app"].as<std::string>(),
+                                                 vm["uuid"].as<std::string>(),
+                                                 vm["endpoint"].as<std::string>());
+
+        worker->set_reactor_count(vm["reactors"].as<size_t>());
+        worker->set_batch_limit(vm["batch-limit"].as<size_t>());
+
+        return worker;
     } catch(const std::exception& e) {
         std::cerr << cocaine::format("ERROR: unable to start the worker - %s", e.what()) << std::endl;
         exit(EXIT_FAILURE);
@@ -0,0 +1,260 @@
+#ifndef COCAINE_GRAPE_MEMO_CACHE
+#define COCAINE_GRAPE_MEMO_CACHE
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/utility.hpp>
+
+// Responses of a memoized event keyed by the request input, see
+// application_t::memoize(). The size of the cache is bounded by the bytes of
+// the inputs and responses it holds, and entries are evicted in CLOCK order:
+// the hand sweeps the entries, sparing the ones hit since its last pass, so
+// hot entries stay while a lookup only has to set a bit. Entries older than
+// the TTL, if there is one, are dropped when they are looked up. Not
+// thread-safe.
+class memo_cache_t :
+    public boost::noncopyable
+{
+    typedef std::chrono::steady_clock clock_type;
+
+    enum: uint32_t {
+        nil = 0xFFFFFFFF
+    };
+
+    struct entry_t {
+        uint64_t hash;
+        std::string input;
+        std::vector<std::string> response;
+        size_t size;
+        clock_type::time_point created;
+        bool referenced;
+        bool used;
+    };
+
+public:
+    typedef std::vector<std::string> response_type;
+
+    struct stats_t {
+        stats_t() :
+            hits(0),
+            misses(0),
+            evictions(0),
+            entries(0),
+            bytes(0)
+        {
+            // pass
+        }
+
+        uint64_t hits;
+        uint64_t misses;
+
+        // Expired entries included.
+        uint64_t evictions;
+
+        size_t entries;
+        size_t bytes;
+    };
+
+public:
+    // A zero TTL keeps the entries until they are evicted.
+    memo_cache_t(size_t capacity,
+                 double ttl = 0) :
+        m_capacity(capacity),
+        m_ttl(std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(ttl))),
+        m_hand(0),
+        m_free(nil)
+    {
+        // pass
+    }
+
+    // Word at a time, as inputs may be large. Collisions are harmless, the
+    // input is compared on lookup anyway.
+    static
+    uint64_t
+    hash(const char *data,
+         size_t size)
+    {
+        const uint64_t k = 0x9E3779B97F4A7C15ULL;
+
+        uint64_t result = size * k;
+        size_t i = 0;
+
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            result = ((result ^ word) * k);
+            result ^= result >> 29;
+        }
+
+        if (i < size) {
+            uint64_t word = 0;
+            std::memcpy(&word, data + i, size - i);
+            result = ((result ^ word) * k);
+        }
+
+        result ^= result >> 31;
+        result *= 0xBF58476D1CE4E5B9ULL;
+        result ^= result >> 32;
+
+        return result;
+    }
+
+    // Inputs and responses larger than this are not worth caching, as they
+    // would flush out a good share of the cache.
+    size_t
+    max_entry() const {
+        return m_capacity / 4;
+    }
+
+    // Null on a miss. The response stays valid until the next insert().
+    const response_type*
+    find(uint64_t hash,
+         const std::string& input)
+    {
+        auto it = m_index.find(hash);
+
+        if (it == m_index.end() || m_entries[it->second].input != input) {
+            ++m_stats.misses;
+            return nullptr;
+        }
+
+        entry_t& entry = m_entries[it->second];
+
+        if (m_ttl.count() && clock_type::now() - entry.created > m_ttl) {
+            release(it->second);
+            ++m_stats.evictions;
+            ++m_stats.misses;
+            return nullptr;
+        }
+
+        entry.referenced = true;
+        ++m_stats.hits;
+
+        return &entry.response;
+    }
+
+    // Replaces an entry with the same hash, returns the number of entries
+    // evicted to make room.
+    size_t
+    insert(uint64_t hash,
+           std::string input,
+           response_type response)
+    {
+        size_t size = input.size();
+
+        for (auto it = response.begin(); it != response.end(); ++it) {
+            size += it->size();
+        }
+
+        if (size > max_entry()) {
+            return 0;
+        }
+
+        auto it = m_index.find(hash);
+
+        if (it != m_index.end()) {
+            release(it->second);
+        }
+
+        size_t evicted = 0;
+
+        while (m_stats.bytes + size > m_capacity) {
+            evict();
+            ++evicted;
+        }
+
+        uint32_t index = m_free;
+
+        if (index != nil) {
+            m_free = static_cast<uint32_t>(m_entries[index].size);
+        } else {
+            index = static_cast<uint32_t>(m_entries.size());
+            m_entries.push_back(entry_t());
+        }
+
+        entry_t& entry = m_entries[index];
+
+        entry.hash = hash;
+        entry.input.swap(input);
+        entry.response.swap(response);
+        entry.size = size;
+        entry.created = clock_type::now();
+        entry.referenced = false;
+        entry.used = true;
+
+        m_index[hash] = index;
+
+        ++m_stats.entries;
+        m_stats.bytes += size;
+        m_stats.evictions += evicted;
+
+        return evicted;
+    }
+
+    const stats_t&
+    stats() const {
+        return m_stats;
+    }
+
+private:
+    void
+    evict() {
+        // NOTE: Terminates within two turns, the first one clears all the
+        // reference bits at worst.
+        while (true) {
+            if (m_hand >= m_entries.size()) {
+                m_hand = 0;
+            }
+
+            entry_t& entry = m_entries[m_hand];
+
+            if (entry.used) {
+                if (!entry.referenced) {
+                    release(m_hand++);
+                    return;
+                }
+
+                entry.referenced = false;
+            }
+
+            ++m_hand;
+        }
+    }
+
+    // The free list is threaded through the size field.
+    void
+    release(uint32_t index) {
+        entry_t& entry = m_entries[index];
+
+        m_index.erase(entry.hash);
+
+        --m_stats.entries;
+        m_stats.bytes -= entry.size;
+
+        std::string().swap(entry.input);
+        response_type().swap(entry.response);
+
+        entry.used = false;
+        entry.size = m_free;
+
+        m_free = index;
+    }
+
+private:
+    const size_t m_capacity;
+    const clock_type::duration m_ttl;
+
+    std::vector<entry_t> m_entries;
+    std::unordered_map<uint64_t, uint32_t> m_index;
+
+    size_t m_hand;
+    uint32_t m_free;
+
+    stats_t m_stats;
+};
+
+#endif // COCAINE_GRAPE_MEMO_CACHE
@@ -0,0 +1,157 @@
+#include "metrics.hpp"
+
+#include <sstream>
+
+namespace {
+    std::atomic<size_t> next_shard(0);
+
+    void
+    dump_histogram(std::ostream& stream,
+                   const histogram_t::snapshot_t& histogram)
+    {
+        stream << "{\"p50\": " << histogram.quantile(0.5)
+               << ", \"p90\": " << histogram.quantile(0.9)
+               << ", \"p99\": " << histogram.quantile(0.99)
+               << ", \"p999\": " << histogram.quantile(0.999)
+               << "}";
+    }
+}
+
+uint64_t
+histogram_t::snapshot_t::quantile(double q) const {
+    if(count == 0) {
+        return 0;
+    }
+
+    const uint64_t rank = static_cast<uint64_t>(q * (count - 1));
+    uint64_t seen = 0;
+
+    for(size_t i = 0; i < buckets; ++i) {
+        seen += counts[i];
+
+        if(seen > rank) {
+            return lower_bound(i);
+        }
+    }
+
+    return lower_bound(buckets - 1);
+}
+
+void
+histogram_t::collect(snapshot_t& snapshot) const {
+    for(size_t i = 0; i < buckets; ++i) {
+        const uint64_t count = m_counts[i].load(std::memory_order_relaxed);
+
+        snapshot.counts[i] += count;
+        snapshot.count += count;
+    }
+}
+
+event_metrics_t::event_metrics_t() {
+    for(size_t i = 0; i < shards; ++i) {
+        m_shards[i].invokes.store(0, std::memory_order_relaxed);
+        m_shards[i].errors.store(0, std::memory_order_relaxed);
+        m_shards[i].finished.store(0, std::memory_order_relaxed);
+        m_shards[i].bytes_in.store(0, std::memory_order_relaxed);
+        m_shards[i].bytes_out.store(0, std::memory_order_relaxed);
+        m_shards[i].cache_hits.store(0, std::memory_order_relaxed);
+        m_shards[i].cache_misses.store(0, std::memory_order_relaxed);
+        m_shards[i].cache_evictions.store(0, std::memory_order_relaxed);
+    }
+}
+
+event_metrics_t::shard_t&
+event_metrics_t::local() {
+    // NOTE: Threads are spread over the shards round-robin, once and for all.
+    static thread_local size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % shards;
+
+    return m_shards[shard];
+}
+
+event_metrics_t::snapshot_t
+event_metrics_t::snapshot() const {
+    snapshot_t snapshot;
+
+    for(size_t i = 0; i < shards; ++i) {
+        const shard_t& shard = m_shards[i];
+
+        snapshot.invokes += shard.invokes.load(std::memory_order_relaxed);
+        snapshot.errors += shard.errors.load(std::memory_order_relaxed);
+        snapshot.finished += shard.finished.load(std::memory_order_relaxed);
+        snapshot.bytes_in += shard.bytes_in.load(std::memory_order_relaxed);
+        snapshot.bytes_out += shard.bytes_out.load(std::memory_order_relaxed);
+        snapshot.cache_hits += shard.cache_hits.load(std::memory_order_relaxed);
+        snapshot.cache_misses += shard.cache_misses.load(std::memory_order_relaxed);
+        snapshot.cache_evictions += shard.cache_evictions.load(std::memory_order_relaxed);
+
+        shard.first_write.collect(snapshot.first_write);
+        shard.close.collect(snapshot.close);
+    }
+
+    return snapshot;
+}
+
+std::shared_ptr<event_metrics_t>
+metrics_t::get(const std::string& event) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::shared_ptr<event_metrics_t>& metrics = m_events[event];
+
+    if(!metrics) {
+        metrics = std::make_shared<event_metrics_t>();
+    }
+
+    return metrics;
+}
+
+metrics_t::event_map_t
+metrics_t::events() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_events;
+}
+
+std::string
+metrics_t::dump() const {
+    const event_map_t events(this->events());
+    std::ostringstream stream;
+
+    stream << "{";
+
+    for(auto it = events.begin(); it != events.end(); ++it) {
+        const event_metrics_t::snapshot_t snapshot(it->second->snapshot());
+
+        if(it != events.begin()) {
+            stream << ", ";
+        }
+
+        // NOTE: Event names are registered by the application code and are
+        // not expected to need escaping.
+        stream << "\"" << it->first << "\": {"
+               << "\"invokes\": " << snapshot.invokes
+               << ", \"errors\": " << snapshot.errors
+               << ", \"in-flight\": " << snapshot.in_flight()
+               << ", \"bytes-in\": " << snapshot.bytes_in
+               << ", \"bytes-out\": " << snapshot.bytes_out
+               << ", \"first-write\": ";
+
+        dump_histogram(stream, snapshot.first_write);
+
+        stream << ", \"close\": ";
+
+        dump_histogram(stream, snapshot.close);
+
+        if(snapshot.cache_hits || snapshot.cache_misses) {
+            stream << ", \"cache\": {"
+                   << "\"hits\": " << snapshot.cache_hits
+                   << ", \"misses\": " << snapshot.cache_misses
+                   << ", \"evictions\": " << snapshot.cache_evictions
+                   << "}";
+        }
+
+        stream << "}";
+    }
+
+    stream << "}";
+
+    return stream.str();
+}
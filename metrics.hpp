@@ -0,0 +1,242 @@
+#ifndef COCAINE_GRAPE_METRICS
+#define COCAINE_GRAPE_METRICS
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/utility.hpp>
+
+// Log-linear histogram of latencies in microseconds. Every power of two range
+// is split into eight linear buckets, so a bucket's bounds are never more
+// than 12.5% apart. Recording is a single relaxed atomic increment.
+class histogram_t :
+    public boost::noncopyable
+{
+public:
+    enum {
+        precision = 3,
+        sub_buckets = 1 << precision,
+        buckets = (64 - precision + 1) * sub_buckets
+    };
+
+    struct snapshot_t {
+        snapshot_t() :
+            counts(buckets),
+            count(0)
+        {
+            // pass
+        }
+
+        // Lower bound of the bucket the given quantile falls into.
+        uint64_t
+        quantile(double q) const;
+
+        std::vector<uint64_t> counts;
+        uint64_t count;
+    };
+
+public:
+    histogram_t() {
+        for (size_t i = 0; i < buckets; ++i) {
+            m_counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void
+    record(uint64_t value) {
+        m_counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Adds the current counts to the snapshot.
+    void
+    collect(snapshot_t& snapshot) const;
+
+    static
+    size_t
+    index(uint64_t value) {
+        if (value < sub_buckets) {
+            return value;
+        }
+
+        const size_t shift = 63 - __builtin_clzll(value) - precision;
+
+        return (shift + 1) * sub_buckets + ((value >> shift) - sub_buckets);
+    }
+
+    static
+    uint64_t
+    lower_bound(size_t index) {
+        if (index < sub_buckets) {
+            return index;
+        }
+
+        return static_cast<uint64_t>(index % sub_buckets + sub_buckets) << (index / sub_buckets - 1);
+    }
+
+private:
+    std::atomic<uint64_t> m_counts[buckets];
+};
+
+// Counters and latency histograms of a single event. Every thread records
+// into its own shard, so the hot path never contends on a cache line with
+// other threads; shards are only summed up when a snapshot is taken.
+class event_metrics_t :
+    public boost::noncopyable
+{
+public:
+    typedef std::chrono::steady_clock clock_type;
+
+    struct snapshot_t {
+        snapshot_t() :
+            invokes(0),
+            errors(0),
+            finished(0),
+            bytes_in(0),
+            bytes_out(0),
+            cache_hits(0),
+            cache_misses(0),
+            cache_evictions(0)
+        {
+            // pass
+        }
+
+        uint64_t
+        in_flight() const {
+            return invokes > finished ? invokes - finished : 0;
+        }
+
+        uint64_t invokes;
+        uint64_t errors;
+        uint64_t finished;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+
+        // Only counted for memoized events.
+        uint64_t cache_hits;
+        uint64_t cache_misses;
+        uint64_t cache_evictions;
+
+        // From the invocation to the first response chunk and to the end of
+        // the response respectively.
+        histogram_t::snapshot_t first_write;
+        histogram_t::snapshot_t close;
+    };
+
+public:
+    event_metrics_t();
+
+    void
+    invoked() {
+        local().invokes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void
+    failed() {
+        local().errors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void
+    received(size_t size) {
+        local().bytes_in.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void
+    sent(size_t size) {
+        local().bytes_out.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void
+    cache_hit() {
+        local().cache_hits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void
+    cache_miss() {
+        local().cache_misses.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void
+    cache_evicted(size_t count) {
+        local().cache_evictions.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void
+    first_write(clock_type::time_point start) {
+        local().first_write.record(elapsed(start));
+    }
+
+    void
+    finished(clock_type::time_point start) {
+        shard_t& shard = local();
+
+        shard.finished.fetch_add(1, std::memory_order_relaxed);
+        shard.close.record(elapsed(start));
+    }
+
+    snapshot_t
+    snapshot() const;
+
+private:
+    enum {
+        shards = 8
+    };
+
+    struct shard_t {
+        std::atomic<uint64_t> invokes;
+        std::atomic<uint64_t> errors;
+        std::atomic<uint64_t> finished;
+        std::atomic<uint64_t> bytes_in;
+        std::atomic<uint64_t> bytes_out;
+        std::atomic<uint64_t> cache_hits;
+        std::atomic<uint64_t> cache_misses;
+        std::atomic<uint64_t> cache_evictions;
+
+        histogram_t first_write;
+        histogram_t close;
+
+        char padding[64];
+    };
+
+    shard_t&
+    local();
+
+    static
+    uint64_t
+    elapsed(clock_type::time_point start) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+    }
+
+private:
+    shard_t m_shards[shards];
+};
+
+// Per-event metrics of an application, shared by all its instances.
+class metrics_t :
+    public boost::noncopyable
+{
+public:
+    typedef std::map<std::string, std::shared_ptr<event_metrics_t>> event_map_t;
+
+public:
+    // Returns the metrics of the event, creating them if necessary.
+    std::shared_ptr<event_metrics_t>
+    get(const std::string& event);
+
+    event_map_t
+    events() const;
+
+    // A JSON object with an entry per event.
+    std::string
+    dump() const;
+
+private:
+    mutable std::mutex m_mutex;
+    event_map_t m_events;
+};
+
+#endif // COCAINE_GRAPE_METRICS
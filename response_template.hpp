@@ -0,0 +1,197 @@
+#ifndef COCAINE_GRAPE_RESPONSE_TEMPLATE
+#define COCAINE_GRAPE_RESPONSE_TEMPLATE
+
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+#include <msgpack.hpp>
+
+#include "worker.hpp"
+
+// The status and headers chunk of an HTTP reply, i.e. a {code, headers} map
+// the way the cocaine HTTP proxy expects it, encoded once when the template
+// is built. Applications build their templates in the constructor, next to
+// the event registrations, and handlers send them with write(), optionally
+// adding a few headers which are only known per request.
+class response_template_t {
+    // Collects the encoded bytes.
+    struct buffer_t {
+        void
+        write(const char *data,
+              size_t size)
+        {
+            bytes.insert(bytes.end(), data, data + size);
+        }
+
+        std::vector<char> bytes;
+    };
+
+    // Collects the extra headers on the stack, unless they don't fit. Unlike
+    // the session's arena it may be used on whatever thread the handler runs.
+    struct extra_buffer_t {
+        extra_buffer_t() :
+            size(0)
+        {
+            // pass
+        }
+
+        void
+        write(const char *data,
+              size_t length)
+        {
+            if (spill.empty() && size + length <= sizeof(bytes)) {
+                std::memcpy(bytes + size, data, length);
+                size += length;
+            } else {
+                if (spill.empty()) {
+                    spill.assign(bytes, size);
+                }
+
+                spill.append(data, length);
+            }
+        }
+
+        const char*
+        data() const {
+            return spill.empty() ? bytes : spill.data();
+        }
+
+        size_t
+        length() const {
+            return spill.empty() ? size : spill.size();
+        }
+
+        char bytes[512];
+        size_t size;
+        std::string spill;
+    };
+
+    // Just enough room for an array header.
+    struct header_buffer_t {
+        header_buffer_t() :
+            size(0)
+        {
+            // pass
+        }
+
+        void
+        write(const char *data,
+              size_t length)
+        {
+            for (size_t i = 0; i < length && size < sizeof(bytes); ++i) {
+                bytes[size++] = data[i];
+            }
+        }
+
+        char bytes[8];
+        size_t size;
+    };
+
+public:
+    typedef std::pair<std::string, std::string> header_type;
+
+public:
+    response_template_t(int code,
+                        const std::vector<header_type>& headers = std::vector<header_type>()) :
+        m_count(headers.size())
+    {
+        buffer_t buffer;
+        msgpack::packer<buffer_t> packer(buffer);
+
+        packer.pack_map(2);
+        packer.pack(std::string("code"));
+        packer.pack(code);
+        packer.pack(std::string("headers"));
+
+        m_prefix = buffer.bytes.size();
+
+        packer.pack_array(headers.size());
+
+        m_headers = buffer.bytes.size();
+
+        for (auto it = headers.begin(); it != headers.end(); ++it) {
+            pack(packer, it->first, it->second);
+        }
+
+        m_chunk.assign(buffer.bytes.begin(), buffer.bytes.end());
+    }
+
+    // The encoded chunk.
+    const std::string&
+    chunk() const {
+        return m_chunk;
+    }
+
+    void
+    write(response_stream_t& response) const {
+        response.write(m_chunk.data(), m_chunk.size());
+    }
+
+    // Writes the template with the extra headers appended to the constant
+    // ones. The pre-encoded parts go out as they are, only the extra headers
+    // are encoded.
+    void
+    write(response_stream_t& response,
+          const header_type *extra,
+          size_t count) const
+    {
+        if (count == 0) {
+            write(response);
+            return;
+        }
+
+        header_buffer_t array;
+        msgpack::packer<header_buffer_t>(array).pack_array(m_count + count);
+
+        extra_buffer_t buffer;
+        msgpack::packer<extra_buffer_t> packer(buffer);
+
+        for (size_t i = 0; i < count; ++i) {
+            pack(packer, extra[i].first, extra[i].second);
+        }
+
+        iovec iov[] = {
+            { const_cast<char*>(m_chunk.data()), m_prefix },
+            { array.bytes, array.size },
+            { const_cast<char*>(m_chunk.data()) + m_headers, m_chunk.size() - m_headers },
+            { const_cast<char*>(buffer.data()), buffer.length() }
+        };
+
+        response.write(iov, sizeof(iov) / sizeof(iov[0]));
+    }
+
+    void
+    write(response_stream_t& response,
+          const std::vector<header_type>& extra) const
+    {
+        write(response, extra.data(), extra.size());
+    }
+
+private:
+    template<class Packer>
+    static
+    void
+    pack(Packer& packer,
+         const std::string& name,
+         const std::string& value)
+    {
+        packer.pack_array(2);
+        packer.pack_raw(name.size());
+        packer.pack_raw_body(name.data(), name.size());
+        packer.pack_raw(value.size());
+        packer.pack_raw_body(value.data(), value.size());
+    }
+
+private:
+    std::string m_chunk;
+
+    // Offsets of the header array and of its first element in the chunk,
+    // the array is re-encoded when headers are added.
+    size_t m_prefix;
+    size_t m_headers;
+    size_t m_count;
+};
+
+#endif // COCAINE_GRAPE_RESPONSE_TEMPLATE
@@ -0,0 +1,175 @@
+#ifndef COCAINE_GRAPE_SESSION_TABLE
+#define COCAINE_GRAPE_SESSION_TABLE
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Session storage keyed by the engine-assigned session id. The engine hands
+// out ids in increasing order, so live sessions occupy a sliding window and
+// a ring indexed by the low bits of the id resolves almost every lookup with
+// a single probe. A session whose slot is still taken by an older, long-lived
+// one goes to the overflow map; the ring doubles once the overflow grows, up
+// to a maximum size, past which the overflow map takes whatever doesn't fit.
+template<class T>
+class session_table_t {
+    struct slot_t {
+        slot_t() :
+            id(0),
+            used(false)
+        {
+            // pass
+        }
+
+        uint64_t id;
+        bool used;
+        T value;
+    };
+
+    typedef std::unordered_map<uint64_t, T> overflow_map_t;
+
+public:
+    // Both sizes are rounded up to a power of two.
+    session_table_t(size_t capacity = 1024,
+                    size_t max_capacity = 1 << 20) :
+        m_size(0)
+    {
+        size_t ring = 1;
+
+        while (ring < capacity) {
+            ring <<= 1;
+        }
+
+        m_ring.resize(ring);
+        m_mask = ring - 1;
+
+        while (ring < max_capacity) {
+            ring <<= 1;
+        }
+
+        m_max_ring = ring;
+    }
+
+    // NOTE: The returned pointer is invalidated by the next insert().
+    T*
+    find(uint64_t id) {
+        slot_t& slot = m_ring[id & m_mask];
+
+        if (slot.used && slot.id == id) {
+            return &slot.value;
+        }
+
+        if (!m_overflow.empty()) {
+            typename overflow_map_t::iterator it = m_overflow.find(id);
+
+            if (it != m_overflow.end()) {
+                return &it->second;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Returns false and leaves the table intact if the id is already taken.
+    bool
+    insert(uint64_t id,
+           const T& value)
+    {
+        if (find(id)) {
+            return false;
+        }
+
+        if (m_overflow.size() > m_ring.size() / 4 && m_ring.size() < m_max_ring) {
+            grow();
+        }
+
+        slot_t& slot = m_ring[id & m_mask];
+
+        if (slot.used) {
+            m_overflow.insert(std::make_pair(id, value));
+        } else {
+            slot.id = id;
+            slot.used = true;
+            slot.value = value;
+        }
+
+        ++m_size;
+
+        return true;
+    }
+
+    void
+    erase(uint64_t id) {
+        slot_t& slot = m_ring[id & m_mask];
+
+        if (slot.used && slot.id == id) {
+            slot.used = false;
+            slot.value = T();
+            --m_size;
+        } else if (m_overflow.erase(id)) {
+            --m_size;
+        }
+    }
+
+    size_t
+    size() const {
+        return m_size;
+    }
+
+    bool
+    empty() const {
+        return m_size == 0;
+    }
+
+private:
+    void
+    grow() {
+        std::vector<slot_t> ring(m_ring.size() * 2);
+        overflow_map_t overflow;
+
+        const size_t mask = ring.size() - 1;
+
+        for (auto it = m_ring.begin(); it != m_ring.end(); ++it) {
+            if (it->used) {
+                place(ring, mask, overflow, it->id, it->value);
+            }
+        }
+
+        for (auto it = m_overflow.begin(); it != m_overflow.end(); ++it) {
+            place(ring, mask, overflow, it->first, it->second);
+        }
+
+        m_ring.swap(ring);
+        m_overflow.swap(overflow);
+        m_mask = mask;
+    }
+
+    static
+    void
+    place(std::vector<slot_t>& ring,
+          size_t mask,
+          overflow_map_t& overflow,
+          uint64_t id,
+          const T& value)
+    {
+        slot_t& slot = ring[id & mask];
+
+        if (slot.used) {
+            overflow.insert(std::make_pair(id, value));
+        } else {
+            slot.id = id;
+            slot.used = true;
+            slot.value = value;
+        }
+    }
+
+private:
+    std::vector<slot_t> m_ring;
+    size_t m_mask;
+    size_t m_max_ring;
+    overflow_map_t m_overflow;
+    size_t m_size;
+};
+
+#endif // COCAINE_GRAPE_SESSION_TABLE
@@ -0,0 +1,261 @@
+#ifndef COCAINE_GRAPE_TIMER_WHEEL
+#define COCAINE_GRAPE_TIMER_WHEEL
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hierarchical timing wheel with a fixed number of levels of 64 slots each,
+// time being counted in abstract ticks. Scheduling and cancelling a timer is
+// O(1); a timer far in the future sits in an upper level and is cascaded down
+// a level at a time as the wheel turns. Timers are kept in a node pool and
+// linked by index, so they are identified by a plain handle and a steady
+// state doesn't allocate. Not thread-safe.
+template<class T>
+class timer_wheel_t {
+    enum {
+        slot_bits = 6,
+        slots = 1 << slot_bits,
+        levels = 4
+    };
+
+    enum: uint32_t {
+        nil = 0xFFFFFFFF
+    };
+
+    struct node_t {
+        uint64_t expires;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t slot;
+        T value;
+    };
+
+public:
+    typedef uint32_t handle_type;
+
+    static const handle_type npos = nil;
+
+public:
+    timer_wheel_t() :
+        m_now(0),
+        m_free(nil),
+        m_size(0)
+    {
+        m_heads.assign(levels * slots, nil);
+    }
+
+    // The next tick to be processed by advance().
+    uint64_t
+    now() const {
+        return m_now;
+    }
+
+    size_t
+    size() const {
+        return m_size;
+    }
+
+    bool
+    empty() const {
+        return m_size == 0;
+    }
+
+    // Moves an empty wheel straight to the given tick, which otherwise would
+    // have to be turned through every tick in between by the first advance().
+    void
+    seek(uint64_t tick) {
+        if (m_size == 0) {
+            m_now = tick;
+        }
+    }
+
+    // Timers already due expire on the next advance().
+    handle_type
+    schedule(uint64_t expires,
+             const T& value)
+    {
+        uint32_t index = m_free;
+
+        if (index != nil) {
+            m_free = m_nodes[index].next;
+        } else {
+            index = static_cast<uint32_t>(m_nodes.size());
+            m_nodes.push_back(node_t());
+        }
+
+        node_t& node = m_nodes[index];
+
+        node.expires = expires;
+        node.value = value;
+
+        link(index);
+
+        ++m_size;
+
+        return index;
+    }
+
+    void
+    cancel(handle_type handle) {
+        unlink(handle);
+        release(handle);
+
+        --m_size;
+    }
+
+    handle_type
+    reschedule(handle_type handle,
+               uint64_t expires)
+    {
+        unlink(handle);
+        m_nodes[handle].expires = expires;
+        link(handle);
+
+        return handle;
+    }
+
+    // Processes all the ticks up to and including the given one, calling the
+    // handler with the value of every expired timer. Expired timers are gone
+    // by the time the handler is called, which may schedule and cancel others.
+    template<class F>
+    void
+    advance(uint64_t tick,
+            F handler)
+    {
+        if (m_size == 0) {
+            // Nothing to cascade, so just jump ahead.
+            if (tick >= m_now) {
+                m_now = tick + 1;
+            }
+
+            return;
+        }
+
+        while (m_now <= tick) {
+            const size_t index = m_now & (slots - 1);
+
+            if (index == 0) {
+                cascade(1);
+            }
+
+            uint32_t& head = m_heads[index];
+
+            while (head != nil) {
+                const uint32_t node = head;
+
+                unlink(node);
+
+                // NOTE: Timers beyond the wheel's horizon come back here
+                // before they are due, so they are put back in.
+                if (m_nodes[node].expires > m_now) {
+                    link(node);
+                    continue;
+                }
+
+                T value = m_nodes[node].value;
+
+                release(node);
+                --m_size;
+
+                handler(value);
+            }
+
+            ++m_now;
+
+            if (m_size == 0 && m_now <= tick) {
+                m_now = tick + 1;
+            }
+        }
+    }
+
+private:
+    void
+    cascade(size_t level) {
+        if (level >= levels) {
+            return;
+        }
+
+        const size_t index = (m_now >> (level * slot_bits)) & (slots - 1);
+
+        // The upper level has to be emptied into this one first, as it turns
+        // over at the same moment.
+        if (index == 0) {
+            cascade(level + 1);
+        }
+
+        uint32_t node = m_heads[level * slots + index];
+
+        m_heads[level * slots + index] = nil;
+
+        while (node != nil) {
+            const uint32_t next = m_nodes[node].next;
+            link(node);
+            node = next;
+        }
+    }
+
+    void
+    link(uint32_t index) {
+        node_t& node = m_nodes[index];
+
+        const uint64_t horizon = static_cast<uint64_t>(1) << (levels * slot_bits);
+        const uint64_t expires = node.expires < m_now ? m_now :
+            (node.expires - m_now >= horizon ? m_now + horizon - 1 : node.expires);
+
+        const uint64_t delta = expires - m_now;
+
+        size_t level = 0;
+
+        while (level + 1 < levels && delta >= (static_cast<uint64_t>(1) << ((level + 1) * slot_bits))) {
+            ++level;
+        }
+
+        const uint32_t slot = level * slots + ((expires >> (level * slot_bits)) & (slots - 1));
+
+        node.slot = slot;
+        node.prev = nil;
+        node.next = m_heads[slot];
+
+        if (node.next != nil) {
+            m_nodes[node.next].prev = index;
+        }
+
+        m_heads[slot] = index;
+    }
+
+    void
+    unlink(uint32_t index) {
+        node_t& node = m_nodes[index];
+
+        if (node.prev != nil) {
+            m_nodes[node.prev].next = node.next;
+        } else {
+            m_heads[node.slot] = node.next;
+        }
+
+        if (node.next != nil) {
+            m_nodes[node.next].prev = node.prev;
+        }
+    }
+
+    void
+    release(uint32_t index) {
+        m_nodes[index].value = T();
+        m_nodes[index].next = m_free;
+        m_free = index;
+    }
+
+private:
+    uint64_t m_now;
+
+    std::vector<node_t> m_nodes;
+    std::vector<uint32_t> m_heads;
+    uint32_t m_free;
+    size_t m_size;
+};
+
+template<class T>
+const typename timer_wheel_t<T>::handle_type timer_wheel_t<T>::npos;
+
+#endif // COCAINE_GRAPE_TIMER_WHEEL
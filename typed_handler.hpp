@@ -0,0 +1,328 @@
+#ifndef COCAINE_GRAPE_TYPED_HANDLER
+#define COCAINE_GRAPE_TYPED_HANDLER
+
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <msgpack.hpp>
+
+#include "worker.hpp"
+
+// The zone requests are decoded with. Decoded objects are converted to the
+// request type right away, so the zone is cleared after every request and
+// keeps its chunks for the next one on the same thread.
+inline
+msgpack::zone&
+local_zone() {
+    static thread_local msgpack::zone zone;
+    return zone;
+}
+
+// Handles a request which is a single msgpack object, possibly spread over
+// several chunks, by converting it to the request type, calling the function
+// and sending the result back as a single msgpack encoded chunk. A request
+// arriving in one chunk, which is the usual case, is decoded right from the
+// receive buffer and never copied. A split one is fed to an unpacker, which
+// picks up the decoding where the previous chunk has left it.
+template<class Request, class Response>
+class typed_handler_t :
+    public base_handler_t
+{
+    // Clears the zone however the decoding ends.
+    struct zone_guard_t {
+        ~zone_guard_t() {
+            zone.clear();
+        }
+
+        msgpack::zone& zone;
+    };
+
+public:
+    typedef std::function<Response(const Request&)> function_type;
+
+public:
+    typed_handler_t(function_type f) :
+        m_func(f),
+        m_decoded(false),
+        m_split(false)
+    {
+        // pass
+    }
+
+    void
+    invoke(const std::string& /* event */,
+           std::shared_ptr<response_stream_t> response)
+    {
+        m_response = response;
+    }
+
+    void
+    write(const char *chunk,
+          size_t size)
+    {
+        if (m_decoded) {
+            throw cocaine::error_t("unexpected input after the request");
+        }
+
+        if (!m_split) {
+            if (decode(chunk, size)) {
+                return;
+            }
+
+            if (!m_unpacker) {
+                m_unpacker.reset(new msgpack::unpacker());
+            }
+
+            m_split = true;
+        }
+
+        feed(chunk, size);
+    }
+
+    void
+    close() {
+        if (!m_decoded) {
+            throw cocaine::error_t("the request is incomplete");
+        }
+
+        if (m_response->cancelled()) {
+            return;
+        }
+
+        const Response result(m_func(m_request));
+
+        response_stream_t::chunk_t chunk(m_response->begin_chunk());
+        msgpack::packer<chunk_writer_t> packer(chunk.writer());
+        packer.pack(result);
+        chunk.commit();
+
+        m_response->close();
+    }
+
+    void
+    error(cocaine::error_code /* code */,
+          const std::string& /* message */)
+    {
+        // NOTE: The session is over, so there is no one to respond to.
+        m_response.reset();
+    }
+
+    void
+    reset() {
+        m_request = Request();
+        m_decoded = false;
+
+        // NOTE: The unpacker is kept, but anything left of an unfinished
+        // request has to go.
+        if (m_split) {
+            m_unpacker->remove_nonparsed_buffer();
+            m_unpacker->reset();
+            m_split = false;
+        }
+
+        m_response.reset();
+    }
+
+private:
+    // Returns false if the object is not complete yet.
+    bool
+    decode(const char *data,
+           size_t size)
+    {
+        zone_guard_t guard = { local_zone() };
+
+        msgpack::object object;
+        size_t offset = 0;
+
+        switch (msgpack::unpack(data, size, &offset, &guard.zone, &object)) {
+            case msgpack::UNPACK_SUCCESS:
+                object.convert(&m_request);
+                m_decoded = true;
+                return true;
+
+            case msgpack::UNPACK_CONTINUE:
+                return false;
+
+            case msgpack::UNPACK_EXTRA_BYTES:
+                throw cocaine::error_t("unexpected input after the request");
+
+            default:
+                throw cocaine::error_t("unable to decode the request");
+        }
+    }
+
+    void
+    feed(const char *chunk,
+         size_t size)
+    {
+        m_unpacker->reserve_buffer(size);
+        std::memcpy(m_unpacker->buffer(), chunk, size);
+        m_unpacker->buffer_consumed(size);
+
+        msgpack::unpacked result;
+
+        try {
+            if (!m_unpacker->next(&result)) {
+                return;
+            }
+        } catch (const msgpack::unpack_error&) {
+            throw cocaine::error_t("unable to decode the request");
+        }
+
+        if (m_unpacker->nonparsed_size()) {
+            throw cocaine::error_t("unexpected input after the request");
+        }
+
+        result.get().convert(&m_request);
+        m_decoded = true;
+    }
+
+private:
+    function_type m_func;
+
+    Request m_request;
+    bool m_decoded;
+
+    // Only used when the request is split between chunks. Kept along with
+    // its buffer for the next request once created.
+    bool m_split;
+    std::unique_ptr<msgpack::unpacker> m_unpacker;
+
+    std::shared_ptr<response_stream_t> m_response;
+};
+
+template<class Request, class Response>
+class typed_function_factory_t :
+    public base_factory_t
+{
+    typedef typed_handler_t<Request, Response> handler_type;
+
+public:
+    // A non-zero pool capacity makes the factory recycle its handlers, which
+    // then keep their request objects between invocations as well.
+    typed_function_factory_t(typename handler_type::function_type f,
+                             size_t pool_capacity = 0) :
+        m_func(f),
+        m_pool_capacity(pool_capacity)
+    {
+        // pass
+    }
+
+    std::shared_ptr<base_handler_t>
+    make_handler()
+    {
+        if (m_pool_capacity) {
+            if (!m_pool) {
+                m_pool = std::make_shared<handler_pool_t<handler_type>>(m_pool_capacity);
+            }
+
+            return m_pool->acquire(m_func);
+        }
+
+        return std::shared_ptr<base_handler_t>(new handler_type(m_func));
+    }
+
+    std::shared_ptr<base_factory_t>
+    rebind(application_t * /* a */) const {
+        typed_function_factory_t *factory = new typed_function_factory_t(*this);
+        factory->m_pool.reset();
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
+private:
+    typename handler_type::function_type m_func;
+    size_t m_pool_capacity;
+    std::shared_ptr<handler_pool_t<handler_type>> m_pool;
+};
+
+template<class AppT, class Request, class Response>
+class typed_method_factory_t :
+    public base_factory_t
+{
+    typedef typed_handler_t<Request, Response> handler_type;
+    typedef Response (AppT::*method_type)(const Request&);
+
+public:
+    // See typed_function_factory_t for the pool capacity.
+    typed_method_factory_t(AppT *a,
+                           method_type method,
+                           size_t pool_capacity = 0) :
+        m_method(method),
+        m_pool_capacity(pool_capacity)
+    {
+        set_application(a);
+    }
+
+    std::shared_ptr<base_handler_t>
+    make_handler()
+    {
+        if (m_app) {
+            if (m_pool) {
+                // NOTE: The bound method is only copied if the pool has to
+                // construct a new handler.
+                return m_pool->acquire(m_bound);
+            }
+
+            return std::shared_ptr<base_handler_t>(new handler_type(m_bound));
+        } else {
+            throw bad_factory_exception();
+        }
+    }
+
+    std::shared_ptr<base_factory_t>
+    rebind(application_t *a) const {
+        typed_method_factory_t *factory = new typed_method_factory_t(*this);
+        factory->set_application(dynamic_cast<AppT*>(a));
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
+private:
+    // The method is bound once per application rather than per handler, and
+    // every application gets a pool of its own.
+    void
+    set_application(AppT *a) {
+        m_app = a;
+
+        if (m_app) {
+            m_bound = std::bind(m_method, m_app, std::placeholders::_1);
+        } else {
+            m_bound = nullptr;
+        }
+
+        if (m_pool_capacity) {
+            m_pool = std::make_shared<handler_pool_t<handler_type>>(m_pool_capacity);
+        }
+    }
+
+private:
+    method_type m_method;
+    AppT *m_app;
+    typename handler_type::function_type m_bound;
+    size_t m_pool_capacity;
+    std::shared_ptr<handler_pool_t<handler_type>> m_pool;
+};
+
+template<class Request, class Response>
+void
+application_t::on(const std::string& event,
+                  std::function<Response(const Request&)> function,
+                  size_t pool_capacity)
+{
+    this->on(event, std::shared_ptr<base_factory_t>(
+        new typed_function_factory_t<Request, Response>(function, pool_capacity)
+    ));
+}
+
+template<class Request, class Response, class AppT>
+void
+application_t::on(const std::string& event,
+                  Response (AppT::*method)(const Request&),
+                  size_t pool_capacity)
+{
+    this->on(event, std::shared_ptr<base_factory_t>(
+        new typed_method_factory_t<AppT, Request, Response>(dynamic_cast<AppT*>(this), method, pool_capacity)
+    ));
+}
+
+#endif // COCAINE_GRAPE_TYPED_HANDLER
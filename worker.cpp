@@ -1,4 +1,9 @@
 #include "worker.hpp"
+#include "memo_cache.hpp"
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <cocaine/messages.hpp>
 #include <cocaine/traits/unique_id.hpp>
 
@@ -6,7 +11,8 @@ using namespace cocaine;
 
 namespace {
     class upstream_t:
-        public api::stream_t
+        public response_stream_t,
+        public std::enable_shared_from_this<upstream_t>
     {
         enum class state_t: int {
             open,
@@ -14,10 +20,17 @@ namespace {
         };
     public:
         upstream_t(uint64_t id,
-                   worker_t * const worker):
+                   worker_t * const worker,
+                   std::shared_ptr<arena_t> arena,
+                   std::shared_ptr<std::atomic<bool>> cancelled,
+                   bool deadline):
             m_id(id),
             m_worker(worker),
-            m_state(state_t::open)
+            m_arena(arena),
+            m_cancelled(cancelled),
+            m_deadline(deadline),
+            m_state(state_t::open),
+            m_in_place(false)
         {
             // pass
         }
@@ -29,118 +42,1986 @@ namespace {
             }
         }
 
+        virtual
+        std::shared_ptr<arena_t>
+        arena() const {
+            return m_arena;
+        }
+
         virtual
         void
         write(const char * chunk,
              size_t size)
         {
+            iovec iov = { const_cast<char*>(chunk), size };
+            write(&iov, 1);
+        }
+
+        virtual
+        void
+        write(const iovec *iov,
+              size_t count)
+        {
+            if(m_state == state_t::closed) {
+                throw cocaine::error_t("the stream has been closed");
+            } else if(!cancelled()) {
+                m_worker->send(m_id, iov, count);
+            }
+        }
+
+        virtual
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            if(m_state == state_t::closed) {
+                throw cocaine::error_t("the stream has been closed");
+            } else {
+                m_state = state_t::closed;
+
+                if(!cancelled()) {
+                    send<io::rpc::error>(static_cast<int>(code), message);
+                    send<io::rpc::choke>();
+                }
+
+                m_worker->finish(m_id, m_deadline);
+            }
+        }
+
+        virtual
+        void
+        close() {
+            if(m_state == state_t::closed) {
+                throw cocaine::error_t("the stream has been closed");
+            } else {
+                m_state = state_t::closed;
+
+                if(!cancelled()) {
+                    send<io::rpc::choke>();
+                }
+
+                m_worker->finish(m_id, m_deadline);
+            }
+        }
+
+        virtual
+        bool
+        cancelled() const {
+            return m_cancelled->load(std::memory_order_acquire);
+        }
+
+        virtual
+        chunk_writer_t&
+        open_chunk() {
             if(m_state == state_t::closed) {
                 throw cocaine::error_t("the stream has been closed");
+            }
+
+            // NOTE: A cancelled session's chunk is collected aside and dropped.
+            m_in_place = !cancelled();
+
+            if(m_in_place) {
+                return m_worker->begin_chunk(m_id);
             } else {
-                send<io::rpc::chunk>(std::string(chunk, size));
+                return response_stream_t::open_chunk();
+            }
+        }
+
+        virtual
+        void
+        commit_chunk() {
+            if(m_in_place) {
+                m_in_place = false;
+                m_worker->commit_chunk(m_id);
+            } else {
+                response_stream_t::commit_chunk();
+            }
+        }
+
+        virtual
+        void
+        abort_chunk() {
+            if(m_in_place) {
+                m_in_place = false;
+                m_worker->abort_chunk(m_id);
+            } else {
+                response_stream_t::abort_chunk();
+            }
+        }
+
+        virtual
+        bool
+        writable() const {
+            return !m_worker->congested();
+        }
+
+        virtual
+        void
+        on_drain(std::function<void()> callback) {
+            std::weak_ptr<upstream_t> self(shared_from_this());
+            m_worker->on_drain(std::bind(&upstream_t::drained, self, callback));
+        }
+
+    private:
+        template<class Event, typename... Args>
+        void
+        send(Args&&... args) {
+            m_worker->send<Event>(m_id, std::forward<Args>(args)...);
+        }
+
+        static
+        void
+        drained(const std::weak_ptr<upstream_t>& self,
+                const std::function<void()>& callback)
+        {
+            std::shared_ptr<upstream_t> upstream(self.lock());
+
+            if(upstream && upstream->m_state == state_t::open && !upstream->cancelled()) {
+                callback();
+            }
+        }
+
+    private:
+        const uint64_t m_id;
+        worker_t * const m_worker;
+        std::shared_ptr<arena_t> m_arena;
+        const std::shared_ptr<std::atomic<bool>> m_cancelled;
+
+        // The session has a total deadline, which is armed until the response
+        // is over.
+        const bool m_deadline;
+
+        state_t m_state;
+        bool m_in_place;
+    };
+
+    // Unpacks a chunk message without copying the payload out of the decoder
+    // buffer, which stays intact until the message has been dispatched.
+    void
+    unpack_chunk(const io::message_t& message,
+                 uint64_t& session_id,
+                 const char *& chunk,
+                 size_t& size)
+    {
+        const msgpack::object& args = message.args();
+
+        if(args.type != msgpack::type::ARRAY ||
+           args.via.array.size != 2 ||
+           args.via.array.ptr[1].type != msgpack::type::RAW)
+        {
+            throw cocaine::error_t("unable to unpack the message arguments");
+        }
+
+        args.via.array.ptr[0].convert(&session_id);
+
+        chunk = args.via.array.ptr[1].via.raw.ptr;
+        size = args.via.array.ptr[1].via.raw.size;
+    }
+
+    // Response stream of an offloaded handler. It may be used from any thread
+    // and forwards everything to the real upstream on the loop thread. Drain
+    // callbacks are sent back to the handler through the home dispatcher.
+    class marshalled_stream_t:
+        public response_stream_t,
+        public std::enable_shared_from_this<marshalled_stream_t>
+    {
+    public:
+        typedef std::function<void(executor_t::task_type)> dispatcher_type;
+
+    public:
+        marshalled_stream_t(std::shared_ptr<response_stream_t> upstream,
+                            executor_t *loop,
+                            dispatcher_type home):
+            m_upstream(upstream),
+            m_loop(loop),
+            m_home(home),
+            m_closed(false)
+        {
+            // pass
+        }
+
+        virtual
+        ~marshalled_stream_t() {
+            // NOTE: The upstream must die on the loop thread, as it might
+            // have to close itself in the process.
+            m_loop->post(std::bind(&marshalled_stream_t::release, m_upstream));
+        }
+
+        virtual
+        std::shared_ptr<arena_t>
+        arena() const {
+            return m_upstream->arena();
+        }
+
+        virtual
+        void
+        write(const char * chunk,
+             size_t size)
+        {
+            check();
+            m_loop->post(std::bind(&marshalled_stream_t::do_write, m_upstream, std::string(chunk, size)));
+        }
+
+        virtual
+        void
+        write(const iovec *iov,
+              size_t count)
+        {
+            check();
+
+            std::string chunk;
+
+            for(size_t i = 0; i < count; ++i) {
+                chunk.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+            }
+
+            m_loop->post(std::bind(&marshalled_stream_t::do_write, m_upstream, std::move(chunk)));
+        }
+
+        virtual
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            check();
+            m_closed = true;
+            m_loop->post(std::bind(&marshalled_stream_t::do_error, m_upstream, code, message));
+        }
+
+        virtual
+        void
+        close() {
+            check();
+            m_closed = true;
+            m_loop->post(std::bind(&marshalled_stream_t::do_close, m_upstream));
+        }
+
+        // NOTE: Only the congestion and cancellation flags are read here,
+        // which is thread-safe.
+        virtual
+        bool
+        writable() const {
+            return m_upstream->writable();
+        }
+
+        virtual
+        bool
+        cancelled() const {
+            return m_upstream->cancelled();
+        }
+
+        virtual
+        void
+        on_drain(std::function<void()> callback) {
+            check();
+
+            std::weak_ptr<marshalled_stream_t> self(shared_from_this());
+            std::function<void()> drained(std::bind(&marshalled_stream_t::drained, self, callback));
+
+            m_loop->post(std::bind(&marshalled_stream_t::do_on_drain, m_upstream, m_home, drained));
+        }
+
+    private:
+        void
+        check() const {
+            if(m_closed) {
+                throw cocaine::error_t("the stream has been closed");
+            }
+        }
+
+        // NOTE: By the time these run the session might have been already
+        // terminated on the loop side, so the errors are ignored.
+
+        static
+        void
+        do_write(const std::shared_ptr<response_stream_t>& upstream,
+                 const std::string& chunk)
+        {
+            try {
+                upstream->write(chunk.data(), chunk.size());
+            } catch(...) {
+                // pass
+            }
+        }
+
+        static
+        void
+        do_error(const std::shared_ptr<response_stream_t>& upstream,
+                 error_code code,
+                 const std::string& message)
+        {
+            try {
+                upstream->error(code, message);
+            } catch(...) {
+                // pass
+            }
+        }
+
+        static
+        void
+        do_close(const std::shared_ptr<response_stream_t>& upstream) {
+            try {
+                upstream->close();
+            } catch(...) {
+                // pass
+            }
+        }
+
+        static
+        void
+        do_on_drain(const std::shared_ptr<response_stream_t>& upstream,
+                    const dispatcher_type& home,
+                    const std::function<void()>& drained)
+        {
+            try {
+                upstream->on_drain(std::bind(home, drained));
+            } catch(...) {
+                // pass
+            }
+        }
+
+        // Runs on the handler's side.
+        static
+        void
+        drained(const std::weak_ptr<marshalled_stream_t>& self,
+                const std::function<void()>& callback)
+        {
+            std::shared_ptr<marshalled_stream_t> stream(self.lock());
+
+            if(stream && !stream->m_closed) {
+                callback();
+            }
+        }
+
+        static
+        void
+        release(const std::shared_ptr<response_stream_t>& /* upstream */) {
+            // pass
+        }
+
+    private:
+        std::shared_ptr<response_stream_t> m_upstream;
+        executor_t * const m_loop;
+        const dispatcher_type m_home;
+        bool m_closed;
+    };
+
+    // Runs the wrapped handler on the thread pool. The calls are queued and
+    // executed one at a time in order, so the handler needs no locking of its
+    // own, while different sessions proceed in parallel.
+    class offloaded_handler_t:
+        public base_handler_t
+    {
+        struct strand_t {
+            std::shared_ptr<base_handler_t> handler;
+            std::shared_ptr<response_stream_t> response;
+            executor_t *pool;
+
+            std::mutex mutex;
+            std::deque<executor_t::task_type> tasks;
+            bool running;
+
+            // Only touched by the task being run.
+            bool failed;
+            bool invoked;
+        };
+
+    public:
+        offloaded_handler_t(std::shared_ptr<base_handler_t> handler,
+                            executor_t *pool,
+                            executor_t *loop):
+            m_strand(std::make_shared<strand_t>()),
+            m_loop(loop)
+        {
+            m_strand->handler = handler;
+            m_strand->pool = pool;
+            m_strand->running = false;
+            m_strand->failed = false;
+            m_strand->invoked = false;
+        }
+
+        void
+        invoke(const std::string& event,
+               std::shared_ptr<response_stream_t> response)
+        {
+            std::weak_ptr<strand_t> strand(m_strand);
+
+            m_strand->response = std::make_shared<marshalled_stream_t>(
+                response,
+                m_loop,
+                std::bind(&offloaded_handler_t::post, strand, std::placeholders::_1)
+            );
+
+            enqueue(m_strand, std::bind(&offloaded_handler_t::do_invoke, m_strand.get(), event));
+        }
+
+        void
+        write(const char *chunk,
+              size_t size)
+        {
+            std::string data;
+            retain(chunk, size, data);
+            enqueue(m_strand, std::bind(&offloaded_handler_t::do_write, m_strand.get(), std::move(data)));
+        }
+
+        void
+        close() {
+            enqueue(m_strand, std::bind(&offloaded_handler_t::do_close, m_strand.get()));
+        }
+
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            // NOTE: The session is over, so whatever input is still queued
+            // is of no use anymore and the handler is spared the work.
+            {
+                std::lock_guard<std::mutex> lock(m_strand->mutex);
+                m_strand->tasks.clear();
+            }
+
+            enqueue(m_strand, std::bind(&offloaded_handler_t::do_error, m_strand.get(), code, message));
+        }
+
+    private:
+        static
+        void
+        post(const std::weak_ptr<strand_t>& strand,
+             executor_t::task_type task)
+        {
+            std::shared_ptr<strand_t> target(strand.lock());
+
+            if(target) {
+                enqueue(target, std::move(task));
+            }
+        }
+
+        static
+        void
+        enqueue(const std::shared_ptr<strand_t>& strand,
+                executor_t::task_type task)
+        {
+            std::lock_guard<std::mutex> lock(strand->mutex);
+
+            strand->tasks.push_back(std::move(task));
+
+            if(!strand->running) {
+                strand->running = true;
+                strand->pool->post(std::bind(&offloaded_handler_t::drain, strand));
             }
         }
 
-        virtual
-        void
-        error(error_code code,
-              const std::string& message)
-        {
-            if(m_state == state_t::closed) {
-                throw cocaine::error_t("the stream has been closed");
-            } else {
-                m_state = state_t::closed;
-                send<io::rpc::error>(static_cast<int>(code), message);
-                send<io::rpc::choke>();
+        static
+        void
+        drain(const std::shared_ptr<strand_t>& strand) {
+            executor_t::task_type task;
+
+            while(true) {
+                {
+                    std::lock_guard<std::mutex> lock(strand->mutex);
+
+                    if(strand->tasks.empty()) {
+                        strand->running = false;
+                        return;
+                    }
+
+                    task = std::move(strand->tasks.front());
+                    strand->tasks.pop_front();
+                }
+
+                if(strand->failed) {
+                    continue;
+                }
+
+                try {
+                    task();
+                } catch(const std::exception& e) {
+                    fail(*strand, e.what());
+                } catch(...) {
+                    fail(*strand, "unexpected exception");
+                }
+            }
+        }
+
+        static
+        void
+        fail(strand_t& strand,
+             const std::string& message)
+        {
+            strand.failed = true;
+
+            try {
+                strand.response->error(invocation_error, message);
+            } catch(...) {
+                // The handler has already closed the stream.
+            }
+        }
+
+        static
+        void
+        do_invoke(strand_t *strand,
+                  const std::string& event)
+        {
+            strand->invoked = true;
+            strand->handler->invoke(event, strand->response);
+        }
+
+        static
+        void
+        do_write(strand_t *strand,
+                 const std::string& chunk)
+        {
+            strand->handler->write(chunk.data(), chunk.size());
+        }
+
+        static
+        void
+        do_close(strand_t *strand) {
+            strand->handler->close();
+        }
+
+        static
+        void
+        do_error(strand_t *strand,
+                 error_code code,
+                 const std::string& message)
+        {
+            // The invocation itself might have been dropped along with the
+            // rest of the queue.
+            if(strand->invoked) {
+                strand->handler->error(code, message);
+            }
+        }
+
+    private:
+        std::shared_ptr<strand_t> m_strand;
+        executor_t * const m_loop;
+    };
+
+    class offloaded_factory_t:
+        public base_factory_t
+    {
+    public:
+        offloaded_factory_t(std::shared_ptr<base_factory_t> factory,
+                            executor_t *pool,
+                            executor_t *loop):
+            m_factory(factory),
+            m_pool(pool),
+            m_loop(loop)
+        {
+            // pass
+        }
+
+        std::shared_ptr<base_handler_t>
+        make_handler() {
+            return std::make_shared<offloaded_handler_t>(m_factory->make_handler(), m_pool, m_loop);
+        }
+
+    private:
+        std::shared_ptr<base_factory_t> m_factory;
+        executor_t * const m_pool;
+        executor_t * const m_loop;
+    };
+
+    // Reports the evictions the cache has made since the given count.
+    void
+    report_evictions(const memo_cache_t& cache,
+                     uint64_t before,
+                     event_metrics_t *metrics)
+    {
+        if(metrics && cache.stats().evictions > before) {
+            metrics->cache_evicted(cache.stats().evictions - before);
+        }
+    }
+
+    // Response stream of a memoized invocation which missed the cache, keeps
+    // a copy of the response and puts it into the cache once it's complete.
+    // A response closed before the key is set, i.e. before the request is
+    // over, isn't cached.
+    class memoized_stream_t:
+        public response_stream_t
+    {
+    public:
+        memoized_stream_t(std::shared_ptr<response_stream_t> upstream,
+                          std::shared_ptr<memo_cache_t> cache,
+                          event_metrics_t *metrics):
+            m_upstream(upstream),
+            m_cache(cache),
+            m_metrics(metrics),
+            m_size(0),
+            m_recording(true),
+            m_keyed(false),
+            m_hash(0),
+            m_chunk(nullptr)
+        {
+            // pass
+        }
+
+        // Takes the input over as the key of the entry.
+        void
+        set_key(uint64_t hash,
+                std::string& input)
+        {
+            m_keyed = true;
+            m_hash = hash;
+            m_input.swap(input);
+
+            m_size += m_input.size();
+
+            if(m_size > m_cache->max_entry()) {
+                m_recording = false;
+            }
+        }
+
+        virtual
+        std::shared_ptr<arena_t>
+        arena() const {
+            return m_upstream->arena();
+        }
+
+        virtual
+        void
+        write(const char *chunk,
+              size_t size)
+        {
+            record(chunk, size);
+            m_upstream->write(chunk, size);
+        }
+
+        virtual
+        void
+        write(const iovec *iov,
+              size_t count)
+        {
+            if(m_recording) {
+                std::string chunk;
+
+                for(size_t i = 0; i < count; ++i) {
+                    chunk.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+                }
+
+                record(chunk.data(), chunk.size());
+            }
+
+            m_upstream->write(iov, count);
+        }
+
+        virtual
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            m_recording = false;
+            m_upstream->error(code, message);
+        }
+
+        virtual
+        void
+        close() {
+            if(m_recording && m_keyed) {
+                m_recording = false;
+
+                const uint64_t evictions = m_cache->stats().evictions;
+
+                m_cache->insert(m_hash, std::move(m_input), std::move(m_response));
+
+                report_evictions(*m_cache, evictions, m_metrics);
+            }
+
+            m_upstream->close();
+        }
+
+        virtual
+        bool
+        writable() const {
+            return m_upstream->writable();
+        }
+
+        virtual
+        void
+        on_drain(std::function<void()> callback) {
+            m_upstream->on_drain(callback);
+        }
+
+        virtual
+        bool
+        cancelled() const {
+            return m_upstream->cancelled();
+        }
+
+        virtual
+        chunk_writer_t&
+        open_chunk() {
+            m_chunk = &m_upstream->open_chunk();
+            return *m_chunk;
+        }
+
+        virtual
+        void
+        commit_chunk() {
+            record(m_chunk->data(), m_chunk->size());
+            m_upstream->commit_chunk();
+        }
+
+        virtual
+        void
+        abort_chunk() {
+            m_upstream->abort_chunk();
+        }
+
+    private:
+        void
+        record(const char *chunk,
+               size_t size)
+        {
+            if(!m_recording) {
+                return;
+            }
+
+            m_size += size;
+
+            if(m_size > m_cache->max_entry()) {
+                m_recording = false;
+                m_response.clear();
+            } else {
+                m_response.push_back(std::string(chunk, size));
+            }
+        }
+
+    private:
+        const std::shared_ptr<response_stream_t> m_upstream;
+        const std::shared_ptr<memo_cache_t> m_cache;
+        event_metrics_t * const m_metrics;
+
+        memo_cache_t::response_type m_response;
+        size_t m_size;
+        bool m_recording;
+
+        bool m_keyed;
+        uint64_t m_hash;
+        std::string m_input;
+
+        chunk_writer_t *m_chunk;
+    };
+
+    // Answers repeated requests from the cache. The input is buffered until
+    // the request is complete and looked up then, the event's handler is only
+    // made, invoked and given the input on a miss, or as soon as the input
+    // outgrows the cache. Only handlers which don't respond before close(),
+    // like the function handlers, can be memoized.
+    class memoized_handler_t:
+        public base_handler_t
+    {
+    public:
+        memoized_handler_t(std::shared_ptr<base_factory_t> factory,
+                           std::shared_ptr<memo_cache_t> cache,
+                           event_metrics_t *metrics):
+            m_factory(factory),
+            m_cache(cache),
+            m_metrics(metrics)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        invoke(const std::string& event,
+               std::shared_ptr<response_stream_t> response)
+        {
+            m_event = event;
+            m_response = response;
+        }
+
+        virtual
+        void
+        write(const char *chunk,
+              size_t size)
+        {
+            if(m_handler) {
+                m_handler->write(chunk, size);
+                return;
+            }
+
+            retain(chunk, size, m_input);
+            m_boundaries.push_back(m_input.size());
+
+            if(m_input.size() > m_cache->max_entry()) {
+                // Not cacheable, so the handler takes over right away.
+                start(m_response);
+                m_input.clear();
+            }
+        }
+
+        virtual
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            if(m_handler) {
+                m_handler->error(code, message);
+            }
+        }
+
+        virtual
+        void
+        close() {
+            if(m_handler) {
+                m_handler->close();
+                return;
+            }
+
+            const uint64_t hash = memo_cache_t::hash(m_input.data(), m_input.size());
+            const uint64_t evictions = m_cache->stats().evictions;
+            const memo_cache_t::response_type *cached = m_cache->find(hash, m_input);
+
+            // Expired entries are dropped by the lookup.
+            report_evictions(*m_cache, evictions, m_metrics);
+
+            if(m_metrics) {
+                if(cached) {
+                    m_metrics->cache_hit();
+                } else {
+                    m_metrics->cache_miss();
+                }
+            }
+
+            if(cached) {
+                // NOTE: The cache may change as soon as the control gets back
+                // to the loop, so the response is sent right away.
+                if(!m_response->cancelled()) {
+                    for(auto it = cached->begin(); it != cached->end(); ++it) {
+                        m_response->write(it->data(), it->size());
+                    }
+
+                    m_response->close();
+                }
+
+                return;
+            }
+
+            auto stream = std::make_shared<memoized_stream_t>(m_response, m_cache, m_metrics);
+
+            start(stream);
+
+            stream->set_key(hash, m_input);
+
+            m_handler->close();
+        }
+
+    private:
+        // Makes the handler and replays the input to it, chunk by chunk.
+        void
+        start(std::shared_ptr<response_stream_t> response) {
+            m_handler = m_factory->make_handler();
+            m_handler->invoke(m_event, response);
+
+            size_t offset = 0;
+
+            for(auto it = m_boundaries.begin(); it != m_boundaries.end(); ++it) {
+                m_handler->write(m_input.data() + offset, *it - offset);
+                offset = *it;
+            }
+
+            m_boundaries.clear();
+        }
+
+    private:
+        const std::shared_ptr<base_factory_t> m_factory;
+        const std::shared_ptr<memo_cache_t> m_cache;
+        event_metrics_t * const m_metrics;
+
+        std::string m_event;
+        std::shared_ptr<response_stream_t> m_response;
+
+        // The input so far and where every chunk of it ends.
+        std::string m_input;
+        std::vector<size_t> m_boundaries;
+
+        std::shared_ptr<base_handler_t> m_handler;
+    };
+
+    class memoized_factory_t:
+        public base_factory_t
+    {
+    public:
+        memoized_factory_t(std::shared_ptr<base_factory_t> factory,
+                           std::shared_ptr<memo_cache_t> cache,
+                           std::shared_ptr<event_metrics_t> metrics):
+            m_factory(factory),
+            m_cache(cache),
+            m_metrics(metrics)
+        {
+            // pass
+        }
+
+        std::shared_ptr<base_handler_t>
+        make_handler() {
+            return std::make_shared<memoized_handler_t>(m_factory, m_cache, m_metrics.get());
+        }
+
+    private:
+        std::shared_ptr<base_factory_t> m_factory;
+        std::shared_ptr<memo_cache_t> m_cache;
+        std::shared_ptr<event_metrics_t> m_metrics;
+    };
+
+    // Response stream of a metered invocation, accounts the output and the
+    // response latencies to the event.
+    class metered_stream_t:
+        public response_stream_t
+    {
+    public:
+        metered_stream_t(std::shared_ptr<response_stream_t> upstream,
+                         event_metrics_t *metrics):
+            m_upstream(upstream),
+            m_metrics(metrics),
+            m_start(event_metrics_t::clock_type::now()),
+            m_written(false),
+            m_finished(false),
+            m_chunk(nullptr)
+        {
+            // pass
+        }
+
+        virtual
+        ~metered_stream_t() {
+            // NOTE: The upstream closes itself when released.
+            finish();
+        }
+
+        virtual
+        std::shared_ptr<arena_t>
+        arena() const {
+            return m_upstream->arena();
+        }
+
+        virtual
+        void
+        write(const char * chunk,
+             size_t size)
+        {
+            sent(size);
+            m_upstream->write(chunk, size);
+        }
+
+        virtual
+        void
+        write(const iovec *iov,
+              size_t count)
+        {
+            size_t size = 0;
+
+            for(size_t i = 0; i < count; ++i) {
+                size += iov[i].iov_len;
+            }
+
+            sent(size);
+            m_upstream->write(iov, count);
+        }
+
+        virtual
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            // NOTE: A response which is already over refuses the error, which
+            // then doesn't count.
+            m_upstream->error(code, message);
+            m_metrics->failed();
+            finish();
+        }
+
+        virtual
+        void
+        close() {
+            finish();
+            m_upstream->close();
+        }
+
+        virtual
+        bool
+        writable() const {
+            return m_upstream->writable();
+        }
+
+        virtual
+        void
+        on_drain(std::function<void()> callback) {
+            m_upstream->on_drain(callback);
+        }
+
+        virtual
+        bool
+        cancelled() const {
+            return m_upstream->cancelled();
+        }
+
+        virtual
+        chunk_writer_t&
+        open_chunk() {
+            m_chunk = &m_upstream->open_chunk();
+            return *m_chunk;
+        }
+
+        virtual
+        void
+        commit_chunk() {
+            sent(m_chunk->size());
+            m_upstream->commit_chunk();
+        }
+
+        virtual
+        void
+        abort_chunk() {
+            m_upstream->abort_chunk();
+        }
+
+    private:
+        void
+        sent(size_t size) {
+            if(!m_written) {
+                m_written = true;
+                m_metrics->first_write(m_start);
+            }
+
+            m_metrics->sent(size);
+        }
+
+        void
+        finish() {
+            if(!m_finished) {
+                m_finished = true;
+                m_metrics->finished(m_start);
+            }
+        }
+
+    private:
+        std::shared_ptr<response_stream_t> m_upstream;
+        event_metrics_t * const m_metrics;
+        const event_metrics_t::clock_type::time_point m_start;
+        bool m_written;
+        bool m_finished;
+        chunk_writer_t *m_chunk;
+    };
+
+    // Accounts the input of a metered invocation to the event.
+    class metered_handler_t:
+        public base_handler_t
+    {
+    public:
+        metered_handler_t(std::shared_ptr<base_handler_t> handler,
+                          event_metrics_t *metrics):
+            m_handler(handler),
+            m_metrics(metrics)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        invoke(const std::string& event,
+               std::shared_ptr<response_stream_t> response)
+        {
+            m_handler->invoke(event, response);
+        }
+
+        virtual
+        void
+        write(const char *chunk,
+              size_t size)
+        {
+            m_metrics->received(size);
+            m_handler->write(chunk, size);
+        }
+
+        virtual
+        void
+        error(error_code code,
+              const std::string& message)
+        {
+            m_handler->error(code, message);
+        }
+
+        virtual
+        void
+        close() {
+            m_handler->close();
+        }
+
+    private:
+        const std::shared_ptr<base_handler_t> m_handler;
+        event_metrics_t * const m_metrics;
+    };
+
+    // Answers the reserved metrics event.
+    class introspection_handler_t:
+        public base_handler_t
+    {
+    public:
+        introspection_handler_t(const metrics_t *metrics):
+            m_metrics(metrics)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        invoke(const std::string& /* event */,
+               std::shared_ptr<response_stream_t> response)
+        {
+            const std::string dump(m_metrics->dump());
+
+            response->write(dump.data(), dump.size());
+            response->close();
+        }
+
+        virtual
+        void
+        write(const char * /* chunk */,
+              size_t /* size */)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        error(error_code /* code */,
+              const std::string& /* message */)
+        {
+            // pass
+        }
+
+        virtual
+        void
+        close() {
+            // pass
+        }
+
+    private:
+        const metrics_t * const m_metrics;
+    };
+
+    class introspection_factory_t:
+        public base_factory_t
+    {
+    public:
+        introspection_factory_t(const metrics_t *metrics):
+            m_metrics(metrics)
+        {
+            // pass
+        }
+
+        virtual
+        std::shared_ptr<base_handler_t>
+        make_handler() {
+            return std::make_shared<introspection_handler_t>(m_metrics);
+        }
+
+    private:
+        const metrics_t * const m_metrics;
+    };
+
+    struct ignore_t {
+        void
+        operator()(const std::error_code& /* ec */) {
+            // Empty.
+        }
+    };
+}
+
+// Owns a slice of the sessions along with an application instance of its
+// own. The inline reactor runs on the worker's loop; threaded ones run a loop
+// of their own, get their messages through an executor and send everything
+// back through the worker's loop executor.
+class worker_t::reactor_t:
+    public boost::noncopyable
+{
+public:
+    reactor_t(worker_t *worker,
+              std::shared_ptr<application_t> application,
+              arena_pool_t *arenas,
+              bool threaded);
+
+    ~reactor_t();
+
+    bool
+    threaded() const {
+        return m_service != nullptr;
+    }
+
+    // The executor running tasks on the reactor's loop.
+    executor_t*
+    executor() const;
+
+    void
+    post(executor_t::task_type task) {
+        m_executor->post(std::move(task));
+    }
+
+    void
+    invoke(uint64_t session_id,
+           const std::string& event);
+
+    void
+    write(uint64_t session_id,
+          const char *chunk,
+          size_t size);
+
+    void
+    write_copy(uint64_t session_id,
+               const std::string& chunk)
+    {
+        write(session_id, chunk.data(), chunk.size());
+    }
+
+    void
+    close(uint64_t session_id);
+
+    void
+    cancel(uint64_t session_id,
+           int code,
+           const std::string& message);
+
+    // Disarms the deadline of a session whose response is over.
+    void
+    release(uint64_t session_id);
+
+private:
+    void
+    stop();
+
+    ev::loop_ref&
+    loop();
+
+    // Current time in timer wheel ticks.
+    uint64_t
+    now();
+
+    void
+    erase(uint64_t session_id);
+
+    void
+    on_deadline(ev::timer&, int);
+
+    void
+    expire(uint64_t session_id);
+
+private:
+    worker_t * const m_worker;
+
+    // Threaded reactors only.
+    std::unique_ptr<io::service_t> m_service;
+    std::unique_ptr<loop_executor_t> m_executor;
+    std::thread m_thread;
+
+    std::shared_ptr<application_t> m_application;
+
+    // NOTE: Sessions outlive the reactor if their offloaded handlers are still
+    // around, so the pool is owned by the worker rather than shared with every
+    // session, which would cost a pair of atomic reference count updates per
+    // session on the pool itself.
+    arena_pool_t * const m_arenas;
+    stream_map_t m_streams;
+
+    // Session deadlines, all driven by a single timer which only runs while
+    // there is something in the wheel.
+    timer_wheel_t<uint64_t> m_deadlines;
+    std::unique_ptr<ev::timer> m_deadline_timer;
+};
+
+namespace {
+    // Deadlines are accurate to a tick.
+    const double deadline_tick = 0.05;
+}
+
+worker_t::reactor_t::reactor_t(worker_t *worker,
+                               std::shared_ptr<application_t> application,
+                               arena_pool_t *arenas,
+                               bool threaded):
+    m_worker(worker),
+    m_application(application),
+    m_arenas(arenas)
+{
+    if(threaded) {
+        m_service.reset(new io::service_t());
+        m_executor.reset(new loop_executor_t(m_service->loop()));
+    }
+
+    m_deadline_timer.reset(new ev::timer(loop()));
+    m_deadline_timer->set<reactor_t, &reactor_t::on_deadline>(this);
+
+    if(threaded) {
+        m_thread = std::thread([this] { m_service->loop().loop(); });
+    }
+}
+
+worker_t::reactor_t::~reactor_t() {
+    if(threaded()) {
+        post(std::bind(&reactor_t::stop, this));
+        m_thread.join();
+    }
+}
+
+executor_t*
+worker_t::reactor_t::executor() const {
+    return threaded() ? m_executor.get() : m_worker->m_loop_executor.get();
+}
+
+void
+worker_t::reactor_t::stop() {
+    m_deadline_timer->stop();
+    m_service->loop().unloop(ev::ALL);
+}
+
+ev::loop_ref&
+worker_t::reactor_t::loop() {
+    return threaded() ? m_service->loop() : m_worker->m_service.loop();
+}
+
+uint64_t
+worker_t::reactor_t::now() {
+    return static_cast<uint64_t>(loop().now() / deadline_tick);
+}
+
+void
+worker_t::reactor_t::invoke(uint64_t session_id,
+                            const std::string& event)
+{
+    // NOTE: The upstream and whatever the handler carves from the arena go
+    // back to the pool in one piece once the session is over.
+    std::shared_ptr<arena_t> arena(m_arenas->acquire());
+
+    std::shared_ptr<std::atomic<bool>> cancelled(
+        std::allocate_shared<std::atomic<bool>>(arena_allocator_t<std::atomic<bool>>(arena), false)
+    );
+
+    const deadline_t *deadline = m_application->find_deadline(event);
+
+    std::shared_ptr<response_stream_t> upstream(
+        std::allocate_shared<upstream_t>(
+            arena_allocator_t<upstream_t>(arena),
+            session_id,
+            m_worker,
+            arena,
+            cancelled,
+            deadline && deadline->total > 0.0
+        )
+    );
+
+    if(threaded()) {
+        upstream = std::allocate_shared<marshalled_stream_t>(
+            arena_allocator_t<marshalled_stream_t>(arena),
+            upstream,
+            m_worker->m_loop_executor.get(),
+            std::bind(&executor_t::post, m_executor.get(), std::placeholders::_1)
+        );
+    }
+
+    try {
+        // NOTE: The session is failed through the stream the application hands
+        // back, so that metered events account the failure.
+        std::shared_ptr<response_stream_t> stream;
+        std::shared_ptr<base_handler_t> handler(m_application->invoke(event, upstream, &stream));
+
+        io_pair_t io = {
+            stream,
+            handler,
+            timer_wheel_t<uint64_t>::npos,
+            0,
+            0,
+            cancelled,
+            std::weak_ptr<api::stream_t>()
+        };
+
+        if(deadline && (deadline->idle > 0.0 || deadline->total > 0.0)) {
+            const uint64_t start = now();
+
+            m_deadlines.seek(start);
+
+            // NOTE: Rounded up, so that a session never expires early.
+            if(deadline->idle > 0.0) {
+                io.idle = static_cast<uint64_t>(deadline->idle / deadline_tick) + 1;
+            }
+
+            if(deadline->total > 0.0) {
+                io.expires = start + static_cast<uint64_t>(deadline->total / deadline_tick) + 1;
+            }
+
+            io.timer = m_deadlines.schedule(
+                io.idle && (!io.expires || start + io.idle < io.expires) ? start + io.idle : io.expires,
+                session_id
+            );
+
+            if(!m_deadline_timer->is_active()) {
+                m_deadline_timer->start(deadline_tick, deadline_tick);
+            }
+        }
+
+        m_streams.insert(session_id, io);
+    } catch(const std::exception& e) {
+        upstream->error(invocation_error, e.what());
+    } catch(...) {
+        upstream->error(invocation_error, "unexpected exception");
+    }
+}
+
+void
+worker_t::reactor_t::write(uint64_t session_id,
+                           const char *chunk,
+                           size_t size)
+{
+    io_pair_t *io = m_streams.find(session_id);
+
+    // NOTE: This may be a chunk for a failed invocation, in which case there
+    // will be no active stream, or one past the choke, so drop the message.
+    if(io && io->downstream) {
+        if(io->idle) {
+            const uint64_t idle = now() + io->idle;
+            m_deadlines.reschedule(io->timer, io->expires ? std::min(idle, io->expires) : idle);
+        }
+
+        try {
+            io->downstream->write(chunk, size);
+        } catch(const std::exception& e) {
+            io->upstream->error(invocation_error, e.what());
+            erase(session_id);
+        } catch(...) {
+            io->upstream->error(invocation_error, "unexpected exception");
+            erase(session_id);
+        }
+    }
+}
+
+void
+worker_t::reactor_t::close(uint64_t session_id) {
+    io_pair_t *io = m_streams.find(session_id);
+
+    // NOTE: This may be a choke for a failed invocation, in which case there
+    // will be no active stream, or a repeated one, so drop the message.
+    if(io && io->downstream) {
+        try {
+            io->downstream->close();
+        } catch(const std::exception& e) {
+            io->upstream->error(invocation_error, e.what());
+        } catch(...) {
+            io->upstream->error(invocation_error, "unexpected exception");
+        }
+
+        io = m_streams.find(session_id);
+
+        if(!io) {
+            return;
+        }
+
+        // NOTE: The total deadline still holds for the response, so the session
+        // lingers until release() or expire(), without input and without keeping
+        // the response alive. There is no more input to be idle on.
+        if(io->expires && io->timer != timer_wheel_t<uint64_t>::npos) {
+            io->choked = io->upstream;
+            io->upstream.reset();
+            io->downstream.reset();
+            io->timer = m_deadlines.reschedule(io->timer, io->expires);
+        } else {
+            erase(session_id);
+        }
+    }
+}
+
+void
+worker_t::reactor_t::cancel(uint64_t session_id,
+                            int code,
+                            const std::string& message)
+{
+    io_pair_t *io = m_streams.find(session_id);
+
+    if(!io) {
+        return;
+    }
+
+    // NOTE: The flag goes first, so that the upstream is silent from now on
+    // and offloaded work may already see it.
+    io->cancelled->store(true, std::memory_order_release);
+
+    const std::shared_ptr<api::stream_t> downstream(io->downstream);
+
+    erase(session_id);
+
+    if(!downstream) {
+        return;
+    }
+
+    try {
+        downstream->error(static_cast<error_code>(code), message);
+    } catch(...) {
+        // pass
+    }
+}
+
+void
+worker_t::reactor_t::release(uint64_t session_id) {
+    io_pair_t *io = m_streams.find(session_id);
+
+    if(!io) {
+        return;
+    }
+
+    if(io->downstream) {
+        // NOTE: The response is over before the request, so the total deadline
+        // has nothing left to time out. The idle one still reaps the session
+        // if the engine never sends the choke.
+        io->expires = 0;
+
+        if(io->timer == timer_wheel_t<uint64_t>::npos) {
+            return;
+        }
+
+        if(io->idle) {
+            io->timer = m_deadlines.reschedule(io->timer, now() + io->idle);
+        } else {
+            m_deadlines.cancel(io->timer);
+            io->timer = timer_wheel_t<uint64_t>::npos;
+        }
+    } else {
+        erase(session_id);
+    }
+}
+
+void
+worker_t::reactor_t::erase(uint64_t session_id) {
+    io_pair_t *io = m_streams.find(session_id);
+
+    if(io) {
+        if(io->timer != timer_wheel_t<uint64_t>::npos) {
+            m_deadlines.cancel(io->timer);
+        }
+
+        m_streams.erase(session_id);
+    }
+}
+
+void
+worker_t::reactor_t::on_deadline(ev::timer&, int) {
+    m_deadlines.advance(now(), std::bind(&reactor_t::expire, this, std::placeholders::_1));
+
+    if(m_deadlines.empty()) {
+        m_deadline_timer->stop();
+    }
+}
+
+void
+worker_t::reactor_t::expire(uint64_t session_id) {
+    io_pair_t *io = m_streams.find(session_id);
+
+    if(!io) {
+        return;
+    }
+
+    // The timer is gone already.
+    io->timer = timer_wheel_t<uint64_t>::npos;
+
+    // NOTE: A session which has got the choke only has its total deadline
+    // left and no handler input to fail. The response might have been closed
+    // in the meantime, with release() still on its way, in which case it's
+    // either gone or refuses the error, both are fine.
+    const bool total = io->expires && now() >= io->expires;
+    const error_code code = total ? deadline_error : timeout_error;
+    const std::string message(total ? "the session has exceeded its deadline" : "the session has been idle for too long");
+
+    const std::shared_ptr<api::stream_t> downstream(io->downstream);
+    const std::shared_ptr<api::stream_t> upstream(downstream ? io->upstream : io->choked.lock());
+    const std::shared_ptr<std::atomic<bool>> cancelled(io->cancelled);
+
+    m_streams.erase(session_id);
+
+    if(downstream) {
+        try {
+            downstream->error(code, message);
+        } catch(...) {
+            // pass
+        }
+    }
+
+    if(upstream) {
+        try {
+            upstream->error(code, message);
+        } catch(...) {
+            // pass
+        }
+    }
+
+    // NOTE: The session is cancelled just like in cancel(), so that offloaded
+    // work stops as well, but only once the error is out, as a cancelled
+    // upstream stays silent. The upstream of a threaded reactor errors on the
+    // main loop, so the flag has to take the same way.
+    if(threaded()) {
+        m_worker->m_loop_executor->post([cancelled] {
+            cancelled->store(true, std::memory_order_release);
+        });
+    } else {
+        cancelled->store(true, std::memory_order_release);
+    }
+}
+
+worker_t::worker_t(const std::string& name,
+                   const std::string& uuid,
+                   const std::string& endpoint):
+    m_id(uuid),
+    m_heartbeat_timer(m_service.loop()),
+    m_disown_timer(m_service.loop()),
+    m_logger(new logger::remote_t("remote", Json::Value(), m_service)),
+    m_flush_watcher(m_service.loop()),
+    m_batch_limit(0),
+    m_batch(0),
+    m_congested(false),
+    m_pause_backlogged(false),
+    m_metrics_timer(m_service.loop()),
+    m_metrics_interval(60.0),
+    m_loop_executor(new loop_executor_t(m_service.loop())),
+    m_reactor_count(0),
+    m_app_name(name),
+    m_pool_size(std::thread::hardware_concurrency())
+{
+    m_log.reset(new logger::log_t(m_logger, cocaine::format("worker/%s", name)));
+
+    auto socket_ = std::make_shared<io::socket<io::local>>(io::local::endpoint(
+        endpoint.empty() ? format("/var/run/cocaine/engines/%1%", name) : endpoint
+    ));
+
+    m_decoder.reset(new io::decoder<io::readable_stream<io::socket<io::local>>>());
+    m_decoder->attach(std::make_shared<io::readable_stream<io::socket<io::local>>>(m_service, socket_));
+
+    m_writer.reset(new writer_t(m_service, socket_));
+    m_loop_executor->set_writer(m_writer.get());
+
+    using namespace std::placeholders;
+
+    m_decoder->bind(std::bind(&worker_t::on_message, this, _1), ignore_t());
+    m_writer->bind(ignore_t());
+    m_writer->bind_watermark(std::bind(&worker_t::on_watermark, this, _1));
+    m_writer->set_watermarks(4 << 20, 1 << 20);
+
+    // Greet the engine!
+    send<io::rpc::handshake>(m_id);
+
+    // NOTE: The logger doesn't hold up the handshake, records emitted until
+    // it's connected are buffered.
+    m_logger->connect();
+
+    m_heartbeat_timer.set<worker_t, &worker_t::on_heartbeat>(this);
+    m_heartbeat_timer.start(0.0f, 5.0f);
+
+    m_disown_timer.set<worker_t, &worker_t::on_disown>(this);
+    m_disown_timer.start(2.0f);
+
+    m_flush_watcher.set<worker_t, &worker_t::on_flush>(this);
+    m_metrics_timer.set<worker_t, &worker_t::on_metrics>(this);
+}
+
+worker_t::~worker_t() {
+    // pass
+}
+
+void
+worker_t::run() {
+    if (m_application) {
+        m_service.loop().loop();
+    }
+}
+
+void
+worker_t::attach(const std::string& name,
+                 const std::vector<std::shared_ptr<application_t>>& instances)
+{
+    const bool threaded = m_reactor_count > 0;
+
+    for(auto it = instances.begin(); it != instances.end(); ++it) {
+        const std::shared_ptr<application_t>& application = *it;
+
+        application->rebind();
+
+        m_arenas.emplace_back(new arena_pool_t());
+        m_reactors.emplace_back(new reactor_t(this, application, m_arenas.back().get(), threaded));
+
+        if(!application->m_offloaded.empty()) {
+            if(!m_pool) {
+                m_pool.reset(new thread_pool_t(m_pool_size));
+            }
+
+            application->m_pool = m_pool.get();
+            application->m_loop = m_reactors.back()->executor();
+        }
+
+        application->m_metrics = &m_metrics;
+        application->initialize(name, m_logger);
+    }
+
+    m_application = instances.front();
+
+    if(m_metrics_interval > 0.0) {
+        m_metrics_timer.start(m_metrics_interval, m_metrics_interval);
+    }
+}
+
+worker_t::reactor_t&
+worker_t::route(uint64_t session_id) {
+    return *m_reactors[session_id % m_reactors.size()];
+}
+
+void
+worker_t::send(uint64_t session_id,
+               const iovec *iov,
+               size_t count)
+{
+    m_writer->write(session_id, iov, count);
+
+    if(m_pause_backlogged) {
+        mark(session_id);
+    }
+}
+
+chunk_writer_t&
+worker_t::begin_chunk(uint64_t session_id) {
+    return m_writer->begin_chunk(session_id);
+}
+
+void
+worker_t::commit_chunk(uint64_t session_id) {
+    m_writer->commit_chunk(session_id);
+
+    if(m_pause_backlogged) {
+        mark(session_id);
+    }
+}
+
+void
+worker_t::abort_chunk(uint64_t session_id) {
+    m_writer->abort_chunk(session_id);
+}
+
+void
+worker_t::mark(uint64_t session_id) {
+    uint64_t *position = m_marks.find(session_id);
+
+    if(position) {
+        *position = m_writer->position();
+    } else {
+        m_marks.insert(session_id, m_writer->position());
+    }
+}
+
+void
+worker_t::finish(uint64_t session_id,
+                 bool deadline)
+{
+    if(!m_marks.empty()) {
+        m_marks.erase(session_id);
+    }
+
+    if(deadline) {
+        reactor_t& reactor = route(session_id);
+
+        // NOTE: Always posted, as the response may be closed from within the
+        // reactor while it is still busy with the session.
+        reactor.executor()->post(std::bind(&reactor_t::release, &reactor, session_id));
+    }
+}
+
+void
+worker_t::set_watermarks(size_t high,
+                         size_t low)
+{
+    m_writer->set_watermarks(high, low);
+}
+
+void
+worker_t::on_drain(std::function<void()> callback) {
+    if(m_writer->congested()) {
+        m_drain_callbacks.push_back(callback);
+    } else {
+        callback();
+    }
+}
+
+void
+worker_t::on_watermark(bool congested) {
+    m_congested.store(congested, std::memory_order_release);
+
+    if(!congested) {
+        // NOTE: The writer may be in the middle of a handler's write, so the
+        // handlers are only told about it once that is over.
+        m_loop_executor->post(std::bind(&worker_t::on_drained, this));
+    }
+}
+
+void
+worker_t::on_drained() {
+    if(m_writer->congested()) {
+        return;
+    }
+
+    // Everything sent by the handlers in the meantime leaves in one go.
+    scoped_cork_t cork(*m_writer);
+
+    std::vector<std::function<void()>> callbacks;
+    callbacks.swap(m_drain_callbacks);
+
+    for(auto it = callbacks.begin(); it != callbacks.end(); ++it) {
+        (*it)();
+    }
+
+    std::vector<uint64_t> sessions;
+    sessions.swap(m_held_sessions);
+
+    for(auto it = sessions.begin(); it != sessions.end(); ++it) {
+        std::deque<held_t> *held = m_held.find(*it);
+
+        if(!held) {
+            continue;
+        }
+
+        std::deque<held_t> messages;
+        messages.swap(*held);
+        m_held.erase(*it);
+
+        while(!messages.empty()) {
+            // NOTE: The replayed handlers may congest the channel again, the
+            // rest is held back until the next drain, in the same order.
+            if(m_writer->congested()) {
+                m_held.insert(*it, messages);
+                m_held_sessions.insert(m_held_sessions.begin(), it, sessions.end());
+                return;
             }
-        }
 
-        virtual
-        void
-        close() {
-            if(m_state == state_t::closed) {
-                throw cocaine::error_t("the stream has been closed");
+            const held_t& message = messages.front();
+
+            if(message.choke) {
+                deliver(*it);
             } else {
-                m_state = state_t::closed;
-                send<io::rpc::choke>();
+                deliver(*it, message.data.data(), message.data.size());
             }
+
+            messages.pop_front();
         }
+    }
+}
 
-    private:
-        template<class Event, typename... Args>
-        void
-        send(Args&&... args) {
-            m_worker->send<Event>(m_id, std::forward<Args>(args)...);
+bool
+worker_t::hold(uint64_t session_id,
+               const char *chunk,
+               size_t size)
+{
+    std::deque<held_t> *held = m_held.find(session_id);
+
+    if(!held) {
+        if(!m_writer->congested()) {
+            return false;
         }
 
-    private:
-        const uint64_t m_id;
-        worker_t * const m_worker;
-        state_t m_state;
-    };
+        const uint64_t *mark = m_marks.find(session_id);
 
-    struct ignore_t {
-        void
-        operator()(const std::error_code& /* ec */) {
-            // Empty.
+        if(!mark || *mark <= m_writer->sent()) {
+            return false;
         }
-    };
+
+        m_held.insert(session_id, std::deque<held_t>());
+        m_held_sessions.push_back(session_id);
+
+        held = m_held.find(session_id);
+    }
+
+    held_t message = { false, std::string(chunk, size) };
+    held->push_back(message);
+
+    return true;
 }
 
-worker_t::worker_t(const std::string& name,
-                   const std::string& uuid):
-    m_id(uuid),
-    m_heartbeat_timer(m_service.loop()),
-    m_disown_timer(m_service.loop()),
-    m_app_name(name)
-{
-    auto logger = std::shared_ptr<logger::logger_t>
-                      (new logger::remote_t("remote", Json::Value(), m_service));
-
-    m_log.reset(new logger::log_t(logger, cocaine::format("worker/%s", name)));
-
-//    auto endpoint = io::local::endpoint(format(
-//        "%2%/%1%",
-//        engines,
-//        name
-//    ));
-    auto endpoint = io::local::endpoint(format(
-        "/var/run/cocaine/engines/%1%",
-        name
-    ));
+bool
+worker_t::hold(uint64_t session_id) {
+    std::deque<held_t> *held = m_held.find(session_id);
+
+    if(!held) {
+        return false;
+    }
 
-    auto socket_ = std::make_shared<io::socket<io::local>>(endpoint);
+    held_t message = { true, std::string() };
+    held->push_back(message);
 
-    m_channel.reset(new io::channel<io::socket<io::local>>(m_service, socket_));
+    return true;
+}
 
-    using namespace std::placeholders;
+void
+worker_t::set_batch_limit(size_t limit) {
+    if(limit == 0 && m_batch) {
+        flush();
+    }
 
-    m_channel->rd->bind(std::bind(&worker_t::on_message, this, _1), ignore_t());
-    m_channel->wr->bind(ignore_t());
+    m_batch_limit = limit;
+}
 
-    // Greet the engine!
-    send<io::rpc::handshake>(m_id);
+void
+worker_t::on_message(const io::message_t& message) {
+    if(!m_batch_limit) {
+        // Everything the handlers write in response to this message goes out
+        // with a single system call once it has been dispatched.
+        scoped_cork_t cork(*m_writer);
+        dispatch(message);
+        return;
+    }
 
-    m_heartbeat_timer.set<worker_t, &worker_t::on_heartbeat>(this);
-    m_heartbeat_timer.start(0.0f, 5.0f);
+    if(m_batch == 0) {
+        m_writer->cork();
+        m_flush_watcher.start();
+    }
 
-    m_disown_timer.set<worker_t, &worker_t::on_disown>(this);
-    m_disown_timer.start(2.0f);
+    ++m_batch;
+
+    try {
+        dispatch(message);
+    } catch(...) {
+        flush();
+        throw;
+    }
+
+    if(m_batch >= m_batch_limit) {
+        flush();
+    }
 }
 
-worker_t::~worker_t() {
-    // pass
+void
+worker_t::on_flush(ev::prepare&, int) {
+    flush();
 }
 
 void
-worker_t::run() {
-    if (m_application) {
-        m_service.loop().loop();
+worker_t::flush() {
+    m_flush_watcher.stop();
+
+    if(m_batch == 0) {
+        return;
+    }
+
+    m_stats.batches++;
+    m_stats.messages += m_batch;
+    m_stats.max_messages = std::max<uint64_t>(m_stats.max_messages, m_batch);
+
+    m_batch = 0;
+
+    // NOTE: Only what the socket has actually taken counts, which is less than
+    // what is pending if it's congested.
+    const uint64_t sent = m_writer->sent();
+
+    m_writer->uncork();
+
+    const uint64_t bytes = m_writer->sent() - sent;
+
+    if(bytes) {
+        m_stats.flushes++;
+        m_stats.bytes += bytes;
     }
 }
 
 void
-worker_t::on_message(const io::message_t& message) {
+worker_t::dispatch(const io::message_t& message) {
     COCAINE_LOG_DEBUG(
         m_log,
         "worker %s received type %d message",
@@ -162,21 +2043,12 @@ worker_t::on_message(const io::message_t& message) {
 
             COCAINE_LOG_DEBUG(m_log, "worker %s invoking session %s with event '%s'", m_id, session_id, event);
 
-            std::shared_ptr<api::stream_t> upstream(
-                std::make_shared<upstream_t>(session_id, this)
-            );
+            reactor_t& reactor = route(session_id);
 
-            try {
-                io_pair_t io = {
-                    upstream,
-                    m_application->invoke(event, upstream)
-                };
-
-                m_streams.insert(std::make_pair(session_id, io));
-            } catch(const std::exception& e) {
-                upstream->error(invocation_error, e.what());
-            } catch(...) {
-                upstream->error(invocation_error, "unexpected exception");
+            if(reactor.threaded()) {
+                reactor.post(std::bind(&reactor_t::invoke, &reactor, session_id, event));
+            } else {
+                reactor.invoke(session_id, event);
             }
 
             break;
@@ -184,24 +2056,13 @@ worker_t::on_message(const io::message_t& message) {
 
         case io::event_traits<io::rpc::chunk>::id: {
             uint64_t session_id;
-            std::string chunk;
+            const char *chunk;
+            size_t size;
 
-            message.as<io::rpc::chunk>(session_id, chunk);
+            unpack_chunk(message, session_id, chunk, size);
 
-            stream_map_t::iterator it(m_streams.find(session_id));
-
-            // NOTE: This may be a chunk for a failed invocation, in which case there
-            // will be no active stream, so drop the message.
-            if(it != m_streams.end()) {
-                try {
-                    it->second.downstream->write(chunk.data(), chunk.size());
-                } catch(const std::exception& e) {
-                    it->second.upstream->error(invocation_error, e.what());
-                    m_streams.erase(it);
-                } catch(...) {
-                    it->second.upstream->error(invocation_error, "unexpected exception");
-                    m_streams.erase(it);
-                }
+            if(!m_pause_backlogged || !hold(session_id, chunk, size)) {
+                deliver(session_id, chunk, size);
             }
 
             break;
@@ -212,21 +2073,23 @@ worker_t::on_message(const io::message_t& message) {
 
             message.as<io::rpc::choke>(session_id);
 
-            stream_map_t::iterator it = m_streams.find(session_id);
+            if(!m_pause_backlogged || !hold(session_id)) {
+                deliver(session_id);
+            }
 
-            // NOTE: This may be a choke for a failed invocation, in which case there
-            // will be no active stream, so drop the message.
-            if(it != m_streams.end()) {
-                try {
-                    it->second.downstream->close();
-                } catch(const std::exception& e) {
-                    it->second.upstream->error(invocation_error, e.what());
-                } catch(...) {
-                    it->second.upstream->error(invocation_error, "unexpected exception");
-                }
+            break;
+        }
 
-                m_streams.erase(it);
-            }
+        case io::event_traits<io::rpc::error>::id: {
+            uint64_t session_id;
+            int code;
+            std::string reason;
+
+            message.as<io::rpc::error>(session_id, code, reason);
+
+            COCAINE_LOG_DEBUG(m_log, "worker %s cancelling session %s - %s", m_id, session_id, reason);
+
+            cancel(session_id, code, reason);
 
             break;
         }
@@ -245,6 +2108,53 @@ worker_t::on_message(const io::message_t& message) {
     }
 }
 
+void
+worker_t::deliver(uint64_t session_id,
+                  const char *chunk,
+                  size_t size)
+{
+    reactor_t& reactor = route(session_id);
+
+    if(reactor.threaded()) {
+        // NOTE: The chunk has to leave the receive buffer to cross threads.
+        reactor.post(std::bind(&reactor_t::write_copy, &reactor, session_id, std::string(chunk, size)));
+    } else {
+        reactor.write(session_id, chunk, size);
+    }
+}
+
+void
+worker_t::deliver(uint64_t session_id) {
+    reactor_t& reactor = route(session_id);
+
+    if(reactor.threaded()) {
+        reactor.post(std::bind(&reactor_t::close, &reactor, session_id));
+    } else {
+        reactor.close(session_id);
+    }
+}
+
+void
+worker_t::cancel(uint64_t session_id,
+                 int code,
+                 const std::string& reason)
+{
+    // Input held back by flow control is dropped along with the session.
+    if(!m_held.empty()) {
+        m_held.erase(session_id);
+    }
+
+    finish(session_id);
+
+    reactor_t& reactor = route(session_id);
+
+    if(reactor.threaded()) {
+        reactor.post(std::bind(&reactor_t::cancel, &reactor, session_id, code, reason));
+    } else {
+        reactor.cancel(session_id, code, reason);
+    }
+}
+
 void
 worker_t::on_heartbeat(ev::timer&, int) {
     send<io::rpc::heartbeat>();
@@ -262,32 +2172,106 @@ worker_t::on_disown(ev::timer&, int) {
     m_service.loop().unloop(ev::ALL);
 }
 
+void
+worker_t::on_metrics(ev::timer&, int) {
+    const metrics_t::event_map_t events(m_metrics.events());
+
+    for(auto it = events.begin(); it != events.end(); ++it) {
+        const event_metrics_t::snapshot_t snapshot(it->second->snapshot());
+
+        COCAINE_LOG_INFO(
+            m_log,
+            "event '%s': %d invokes, %d errors, %d in flight, %d bytes in, %d bytes out, "
+            "first write p50/p99 %d/%d us, close p50/p99 %d/%d us",
+            it->first,
+            snapshot.invokes,
+            snapshot.errors,
+            snapshot.in_flight(),
+            snapshot.bytes_in,
+            snapshot.bytes_out,
+            snapshot.first_write.quantile(0.5),
+            snapshot.first_write.quantile(0.99),
+            snapshot.close.quantile(0.5),
+            snapshot.close.quantile(0.99)
+        );
+    }
+}
+
 void
 worker_t::terminate(int reason,
                     const std::string& message)
 {
     send<io::rpc::terminate>(reason, message);
+
+    // The loop won't get to the flush watcher anymore.
+    flush();
+
     m_service.loop().unloop(ev::ALL);
 }
 
 
 std::shared_ptr<base_handler_t>
 application_t::invoke(const std::string& event,
-                      std::shared_ptr<cocaine::api::stream_t> response)
+                      std::shared_ptr<response_stream_t> response,
+                      std::shared_ptr<response_stream_t> *stream)
 {
-    auto it = m_handlers.find(event);
+    base_factory_t *factory = nullptr;
+    event_metrics_t *metrics = nullptr;
 
-    if (it != m_handlers.end()) {
-        std::shared_ptr<base_handler_t> new_handler = it->second->make_handler();
-        new_handler->invoke(event, response);
-        return new_handler;
-    } else if (m_default_handler) {
-        std::shared_ptr<base_handler_t> new_handler = m_default_handler->make_handler();
+    if (m_frozen) {
+        factory = m_dispatch.find(event);
+        metrics = m_metered.find(event);
+    } else {
+        auto it = m_handlers.find(event);
+
+        if (it != m_handlers.end()) {
+            factory = it->second.get();
+        }
+    }
+
+    if (!factory) {
+        if (!m_default_handler) {
+            throw std::exception();
+        }
+
+        factory = m_default_handler.get();
+        metrics = m_default_metrics.get();
+    }
+
+    if (!metrics) {
+        std::shared_ptr<base_handler_t> new_handler = factory->make_handler();
         new_handler->invoke(event, response);
+
+        if (stream) {
+            *stream = response;
+        }
+
         return new_handler;
-    } else {
-        throw std::exception();
     }
+
+    metrics->invoked();
+
+    // NOTE: Both wrappers come from the session's arena if there is one. They
+    // are allocated before the handler is invoked, since an offloaded handler
+    // may start using the arena on a pool thread right away.
+    arena_allocator_t<void> allocator(response->arena());
+
+    std::shared_ptr<base_handler_t> new_handler = factory->make_handler();
+    std::shared_ptr<response_stream_t> metered(std::allocate_shared<metered_stream_t>(allocator, response, metrics));
+    std::shared_ptr<base_handler_t> metered_handler(std::allocate_shared<metered_handler_t>(allocator, new_handler, metrics));
+
+    try {
+        new_handler->invoke(event, metered);
+    } catch(...) {
+        metrics->failed();
+        throw;
+    }
+
+    if (stream) {
+        *stream = metered;
+    }
+
+    return metered_handler;
 }
 
 void
@@ -295,6 +2279,56 @@ application_t::on(const std::string& event,
                   std::shared_ptr<base_factory_t> factory)
 {
     m_handlers[event] = factory;
+
+    if (m_frozen) {
+        m_dispatch.build(m_handlers);
+        meter();
+    }
+}
+
+void
+application_t::rebind() {
+    for(auto it = m_handlers.begin(); it != m_handlers.end(); ++it) {
+        std::shared_ptr<base_factory_t> factory = it->second->rebind(this);
+
+        if(factory) {
+            it->second = factory;
+        }
+    }
+
+    if(m_default_handler) {
+        std::shared_ptr<base_factory_t> factory = m_default_handler->rebind(this);
+
+        if(factory) {
+            m_default_handler = factory;
+        }
+    }
+
+    if(m_frozen) {
+        m_dispatch.build(m_handlers);
+    }
+}
+
+void
+application_t::offload(const std::string& event) {
+    m_offloaded.insert(event);
+}
+
+void
+application_t::deadline(const std::string& event,
+                        double idle,
+                        double total)
+{
+    deadline_t limits = { idle, total };
+    m_deadlines[event] = std::make_shared<deadline_t>(limits);
+}
+
+void
+application_t::memoize(const std::string& event,
+                       size_t capacity,
+                       double ttl)
+{
+    m_memoized[event] = std::make_pair(capacity, ttl);
 }
 
 void
@@ -302,10 +2336,64 @@ application_t::on_unregistered(std::shared_ptr<base_factory_t> factory) {
     m_default_handler = factory;
 }
 
+const std::string application_t::metrics_event("__metrics__");
+
 void
 application_t::initialize(const std::string& name,
                           std::shared_ptr<logger::logger_t> logger)
 {
     m_name = name;
     m_log.reset(new logger::log_t(logger, cocaine::format("app/%s", name)));
+
+    if(m_pool && m_loop) {
+        for(auto it = m_offloaded.begin(); it != m_offloaded.end(); ++it) {
+            handlers_map::iterator handler = m_handlers.find(*it);
+
+            if(handler != m_handlers.end()) {
+                handler->second = std::make_shared<offloaded_factory_t>(handler->second, m_pool, m_loop);
+            }
+        }
+    }
+
+    // NOTE: Goes on top of offloading, so hits never leave the loop thread.
+    for(auto it = m_memoized.begin(); it != m_memoized.end(); ++it) {
+        handlers_map::iterator handler = m_handlers.find(it->first);
+
+        if(handler != m_handlers.end()) {
+            handler->second = std::make_shared<memoized_factory_t>(
+                handler->second,
+                std::make_shared<memo_cache_t>(it->second.first, it->second.second),
+                m_metrics ? m_metrics->get(it->first) : std::shared_ptr<event_metrics_t>()
+            );
+        }
+    }
+
+    if(m_metrics) {
+        m_handlers[metrics_event] = std::make_shared<introspection_factory_t>(m_metrics);
+    }
+
+    // The set of events is not expected to change from now on.
+    m_dispatch.build(m_handlers);
+    m_deadline_table.build(m_deadlines);
+    meter();
+    m_frozen = true;
+}
+
+void
+application_t::meter() {
+    if(!m_metrics) {
+        return;
+    }
+
+    for(auto it = m_handlers.begin(); it != m_handlers.end(); ++it) {
+        if(it->first != metrics_event && !m_event_metrics.count(it->first)) {
+            m_event_metrics[it->first] = m_metrics->get(it->first);
+        }
+    }
+
+    if(m_default_handler && !m_default_metrics) {
+        m_default_metrics = m_metrics->get("*");
+    }
+
+    m_metered.build(m_event_metrics);
 }
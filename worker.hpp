@@ -1,21 +1,199 @@
 #ifndef COCAINE_GRAPE_WORKER
 #define COCAINE_GRAPE_WORKER
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <typeinfo>
 #include <functional>
 #include <string>
 #include <map>
+#include <mutex>
+#include <set>
+#include <vector>
 #include <boost/utility.hpp>
 #include <cocaine/common.hpp>
 #include <cocaine/api/stream.hpp>
 #include <cocaine/asio/local.hpp>
 #include <cocaine/asio/service.hpp>
 #include <cocaine/asio/socket.hpp>
-#include <cocaine/rpc/channel.hpp>
+#include <cocaine/asio/readable_stream.hpp>
+#include <cocaine/rpc/decoder.hpp>
 #include <cocaine/unique_id.hpp>
 
+#include "arena.hpp"
+#include "dispatch.hpp"
+#include "executor.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+#include "session_table.hpp"
+#include "timer_wheel.hpp"
+#include "writer.hpp"
 
+// The stream handlers write their responses to. Besides the plain
+// api::stream_t interface it can gather one chunk from several segments.
+class response_stream_t :
+    public cocaine::api::stream_t
+{
+public:
+    using cocaine::api::stream_t::write;
+
+    // The session's arena, which handlers may use for their per-request data
+    // via arena_allocator_t. It lives as long as the stream is referenced and
+    // is not thread-safe, so only the session's handler should allocate from
+    // it. Null when the stream has no arena, the allocator then falls back to
+    // the heap.
+    virtual
+    std::shared_ptr<arena_t>
+    arena() const {
+        return std::shared_ptr<arena_t>();
+    }
+
+    virtual
+    void
+    write(const iovec *iov,
+          size_t count)
+    {
+        std::string chunk;
+
+        for (size_t i = 0; i < count; ++i) {
+            chunk.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+        }
+
+        write(chunk.data(), chunk.size());
+    }
+
+    // Whether the channel to the engine can take more data without growing
+    // its backlog. Writing to a stream which is not writable still succeeds,
+    // it's up to the handler to hold off producing the rest of the response
+    // until on_drain().
+    virtual
+    bool
+    writable() const {
+        return true;
+    }
+
+    // Runs the callback once the stream becomes writable again, right away if
+    // it is writable already. The callback is run on the thread the handler
+    // runs on and is dropped if the stream is closed by then.
+    virtual
+    void
+    on_drain(std::function<void()> callback) {
+        callback();
+    }
+
+    // Set once the engine has cancelled the session, e.g. because the client
+    // has gone away. Long computations should check it every now and then
+    // and give up once it's set. Everything written to a cancelled stream is
+    // dropped. May be called from any thread.
+    virtual
+    bool
+    cancelled() const {
+        return false;
+    }
+
+    // A chunk started by begin_chunk(). Unless it is committed, the chunk is
+    // aborted once the guard goes away, e.g. when the handler throws halfway
+    // through encoding it.
+    class chunk_t :
+        public boost::noncopyable
+    {
+    public:
+        chunk_t(response_stream_t& stream) :
+            m_stream(&stream),
+            m_writer(&stream.open_chunk())
+        {
+            // pass
+        }
+
+        chunk_t(chunk_t&& other) :
+            m_stream(other.m_stream),
+            m_writer(other.m_writer)
+        {
+            other.m_stream = nullptr;
+        }
+
+        ~chunk_t() {
+            if (m_stream) {
+                try {
+                    m_stream->abort_chunk();
+                } catch (...) {
+                    // The stream is gone bad anyway.
+                }
+            }
+        }
+
+        chunk_writer_t&
+        writer() {
+            return *m_writer;
+        }
+
+        void
+        commit() {
+            response_stream_t *stream = m_stream;
+            m_stream = nullptr;
+            stream->commit_chunk();
+        }
+
+    private:
+        response_stream_t *m_stream;
+        chunk_writer_t *m_writer;
+    };
+
+    // Starts a chunk which is then encoded straight into the chunk's writer,
+    // e.g. with a msgpack::packer<chunk_writer_t>, and sent by commit().
+    // Nothing else may be written to any stream in between, or the chunk is
+    // aborted. Streams on the loop thread encode the chunk right into the
+    // outbound buffer, so it is never copied; others, the default included,
+    // collect it and write() it.
+    chunk_t
+    begin_chunk() {
+        return chunk_t(*this);
+    }
+
+    // The parts of a chunk_t, only to be overridden and forwarded by streams.
+    virtual
+    chunk_writer_t&
+    open_chunk() {
+        if (!m_chunk_buffer) {
+            m_chunk_buffer.reset(new chunk_buffer_t());
+        }
+
+        m_chunk_buffer->bytes.clear();
+        m_chunk_buffer->writer = chunk_writer_t(&m_chunk_buffer->bytes);
+
+        return m_chunk_buffer->writer;
+    }
+
+    virtual
+    void
+    commit_chunk() {
+        write(m_chunk_buffer->bytes.data(), m_chunk_buffer->bytes.size());
+        m_chunk_buffer->bytes.clear();
+    }
+
+    virtual
+    void
+    abort_chunk() {
+        if (m_chunk_buffer) {
+            m_chunk_buffer->bytes.clear();
+        }
+    }
+
+private:
+    // Where the default implementation collects a chunk, only allocated by
+    // streams which get to use it.
+    struct chunk_buffer_t {
+        std::vector<char> bytes;
+        chunk_writer_t writer;
+    };
+
+    std::unique_ptr<chunk_buffer_t> m_chunk_buffer;
+};
+
+// NOTE: Chunks are passed to write() as views into the worker's receive
+// buffer, without any copying, and are only valid for the duration of the
+// call. Handlers that need the data afterwards must retain() it.
 class base_handler_t :
     public cocaine::api::stream_t,
     public boost::noncopyable
@@ -24,7 +202,27 @@ public:
     virtual
     void
     invoke(const std::string& event,
-           std::shared_ptr<cocaine::api::stream_t>) = 0;
+           std::shared_ptr<response_stream_t>) = 0;
+
+    // Called by the pooling factories when a finished handler is put back
+    // to the free list, must drop all per-session state (the response stream
+    // first of all) so the instance can serve the next invocation.
+    virtual
+    void
+    reset() {
+        // pass
+    }
+
+protected:
+    // Copies a chunk out of the receive buffer, appending it to the target.
+    static
+    void
+    retain(const char *chunk,
+           size_t size,
+           std::string& target)
+    {
+        target.append(chunk, size);
+    }
 };
 
 template<class AppT>
@@ -51,14 +249,195 @@ struct bad_factory_exception :
     // pass
 };
 
+class application_t;
+
 class base_factory_t {
 public:
+    virtual
+    ~base_factory_t() {
+        // pass
+    }
+
     virtual
     std::shared_ptr<base_handler_t>
     make_handler() = 0;
+
+    // Returns a copy of the factory making handlers for the given application,
+    // used when the application itself is copied. A null result means that
+    // the factory can be shared between the copies as is.
+    virtual
+    std::shared_ptr<base_factory_t>
+    rebind(application_t *a) const {
+        return std::shared_ptr<base_factory_t>();
+    }
 };
 
-class application_t;
+// Keeps finished handlers of one type on a free list and hands them out again
+// instead of allocating new ones. The shared_ptr control blocks are recycled
+// as well, so a warmed up pool serves an invocation without touching malloc.
+template<class HandlerT>
+class handler_pool_t :
+    public std::enable_shared_from_this<handler_pool_t<HandlerT>>,
+    public boost::noncopyable
+{
+    template<class T>
+    struct block_allocator_t {
+        typedef T value_type;
+
+        block_allocator_t(const std::shared_ptr<handler_pool_t>& pool) :
+            m_pool(pool)
+        {
+            // pass
+        }
+
+        template<class U>
+        block_allocator_t(const block_allocator_t<U>& other) :
+            m_pool(other.m_pool)
+        {
+            // pass
+        }
+
+        T*
+        allocate(size_t n) {
+            return static_cast<T*>(m_pool->allocate_block(n * sizeof(T)));
+        }
+
+        void
+        deallocate(T *block,
+                   size_t n)
+        {
+            m_pool->deallocate_block(block, n * sizeof(T));
+        }
+
+        template<class U>
+        bool
+        operator==(const block_allocator_t<U>& other) const {
+            return m_pool == other.m_pool;
+        }
+
+        template<class U>
+        bool
+        operator!=(const block_allocator_t<U>& other) const {
+            return m_pool != other.m_pool;
+        }
+
+        // NOTE: The allocator lives inside the control block and outlives the
+        // recycler, so it is the one keeping the pool alive.
+        std::shared_ptr<handler_pool_t> m_pool;
+    };
+
+    struct recycler_t {
+        void
+        operator()(HandlerT *handler) const {
+            m_pool->release(handler);
+        }
+
+        handler_pool_t *m_pool;
+    };
+
+public:
+    handler_pool_t(size_t capacity) :
+        m_capacity(capacity),
+        m_block_size(0)
+    {
+        // pass
+    }
+
+    ~handler_pool_t() {
+        for (auto it = m_handlers.begin(); it != m_handlers.end(); ++it) {
+            delete *it;
+        }
+
+        for (auto it = m_blocks.begin(); it != m_blocks.end(); ++it) {
+            ::operator delete(*it);
+        }
+    }
+
+    template<typename... Args>
+    std::shared_ptr<base_handler_t>
+    acquire(Args&&... args) {
+        HandlerT *handler = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (!m_handlers.empty()) {
+                handler = m_handlers.back();
+                m_handlers.pop_back();
+            }
+        }
+
+        if (!handler) {
+            handler = new HandlerT(std::forward<Args>(args)...);
+        }
+
+        recycler_t recycler = { this };
+
+        return std::shared_ptr<base_handler_t>(
+            handler,
+            recycler,
+            block_allocator_t<HandlerT>(this->shared_from_this())
+        );
+    }
+
+private:
+    void
+    release(HandlerT *handler) {
+        try {
+            handler->reset();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (m_handlers.size() < m_capacity) {
+                m_handlers.push_back(handler);
+                return;
+            }
+        } catch (...) {
+            // The handler can't be reused, so just get rid of it.
+        }
+
+        delete handler;
+    }
+
+    void*
+    allocate_block(size_t size) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_block_size == 0) {
+            m_block_size = size;
+        }
+
+        if (size == m_block_size && !m_blocks.empty()) {
+            void *block = m_blocks.back();
+            m_blocks.pop_back();
+            return block;
+        }
+
+        return ::operator new(size);
+    }
+
+    void
+    deallocate_block(void *block,
+                     size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (size == m_block_size && m_blocks.size() < m_capacity) {
+            m_blocks.push_back(block);
+        } else {
+            ::operator delete(block);
+        }
+    }
+
+private:
+    // NOTE: Offloaded handlers may be released on the thread pool.
+    std::mutex m_mutex;
+
+    const size_t m_capacity;
+    size_t m_block_size;
+    std::vector<HandlerT*> m_handlers;
+    std::vector<void*> m_blocks;
+};
 
 template<class HandlerT>
 class handler_factory_t :
@@ -85,6 +464,13 @@ public:
         }
     }
 
+    std::shared_ptr<base_factory_t>
+    rebind(application_t *a) const {
+        handler_factory_t *factory = new handler_factory_t(*this);
+        factory->set_application(dynamic_cast<application_type*>(a));
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
 protected:
     void
     set_application(application_type *a) {
@@ -95,6 +481,58 @@ protected:
     application_type *m_app;
 };
 
+// Same as handler_factory_t, but recycles handlers through a handler_pool_t.
+// Handlers must implement reset(). Opt in per event with
+// on<HandlerT, pooled_factory_t>("event").
+template<class HandlerT>
+class pooled_factory_t :
+    public base_factory_t
+{
+    friend class application_t;
+
+    typedef typename HandlerT::application_type application_type;
+
+public:
+    pooled_factory_t(size_t capacity = 1024) :
+        m_app(nullptr),
+        m_capacity(capacity)
+    {
+        // pass
+    }
+
+    std::shared_ptr<base_handler_t>
+    make_handler()
+    {
+        if (m_app) {
+            if (!m_pool) {
+                m_pool = std::make_shared<handler_pool_t<HandlerT>>(m_capacity);
+            }
+
+            return m_pool->acquire(*m_app);
+        } else {
+            throw bad_factory_exception();
+        }
+    }
+
+    std::shared_ptr<base_factory_t>
+    rebind(application_t *a) const {
+        pooled_factory_t *factory = new pooled_factory_t(*this);
+        factory->set_application(dynamic_cast<application_type*>(a));
+        factory->m_pool.reset();
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
+protected:
+    void
+    set_application(application_type *a) {
+        m_app = a;
+    }
+
+protected:
+    application_type *m_app;
+    size_t m_capacity;
+    std::shared_ptr<handler_pool_t<HandlerT>> m_pool;
+};
 
 class function_handler_t :
     public base_handler_t
@@ -103,15 +541,21 @@ public:
     typedef std::function<std::string(const std::string&, const std::vector<std::string>&)>
             function_type;
 public:
-    function_handler_t(function_type f) :
-        m_func(f)
+    // Once the request grows past a non-zero spill threshold, all the input
+    // is kept in a single contiguous buffer instead of a string per chunk,
+    // so the function then gets one element with the whole input.
+    function_handler_t(function_type f,
+                       size_t spill_threshold = 0) :
+        m_func(f),
+        m_spill_threshold(spill_threshold),
+        m_size(0)
     {
         // pass
     }
 
     void
     invoke(const std::string& event,
-           std::shared_ptr<cocaine::api::stream_t> response)
+           std::shared_ptr<response_stream_t> response)
     {
         m_response = response;
         m_event = event;
@@ -121,11 +565,23 @@ public:
     write(const char *chunk,
          size_t size)
     {
-        m_input.push_back(std::string(chunk, size));
+        m_size += size;
+
+        if(m_spill_threshold && m_size > m_spill_threshold) {
+            spill();
+            retain(chunk, size, m_input.front());
+        } else {
+            m_input.push_back(std::string());
+            retain(chunk, size, m_input.back());
+        }
     }
 
     void
     close() {
+        if(m_response->cancelled()) {
+            return;
+        }
+
         std::string result = m_func(m_event, m_input);
         m_response->write(result.data(), result.size());
         m_response->close();
@@ -138,11 +594,42 @@ public:
         // pass
     }
 
+    void
+    reset() {
+        m_input.clear();
+        m_size = 0;
+        m_event.clear();
+        m_response.reset();
+    }
+
+private:
+    void
+    spill() {
+        if(m_input.size() == 1) {
+            return;
+        }
+
+        std::string buffer;
+
+        buffer.reserve(m_size * 2);
+
+        for(auto it = m_input.begin(); it != m_input.end(); ++it) {
+            buffer.append(*it);
+        }
+
+        m_input.assign(1, std::string());
+        m_input.front().swap(buffer);
+    }
+
 private:
     function_type m_func;
+    const size_t m_spill_threshold;
+
     std::vector<std::string> m_input;
+    size_t m_size;
+
     std::string m_event;
-    std::shared_ptr<cocaine::api::stream_t> m_response;
+    std::shared_ptr<response_stream_t> m_response;
 };
 
 template<class AppT>
@@ -155,9 +642,15 @@ class method_factory_t :
     typedef std::function<std::string(AppT*, const std::string&, const std::vector<std::string>&)>
             method_type;
 public:
-    method_factory_t(method_type f) :
+    // A non-zero pool capacity makes the factory recycle its handlers, see
+    // function_handler_t for the spill threshold.
+    method_factory_t(method_type f,
+                     size_t pool_capacity = 0,
+                     size_t spill_threshold = 0) :
         m_func(f),
-        m_app(nullptr)
+        m_app(nullptr),
+        m_pool_capacity(pool_capacity),
+        m_spill_threshold(spill_threshold)
     {
         // pass
     }
@@ -166,34 +659,66 @@ public:
     make_handler()
     {
         if (m_app) {
+            if (m_pool_capacity) {
+                if (!m_pool) {
+                    m_pool = std::make_shared<handler_pool_t<function_handler_t>>(m_pool_capacity);
+                }
+
+                // NOTE: The bound function is only copied if the pool has to
+                // construct a new handler.
+                return m_pool->acquire(m_bound, m_spill_threshold);
+            }
+
             return std::shared_ptr<base_handler_t>(
-                new function_handler_t(std::bind(m_func,
-                                                 m_app,
-                                                 std::placeholders::_1,
-                                                 std::placeholders::_2))
+                new function_handler_t(m_bound, m_spill_threshold)
             );
         } else {
             throw bad_factory_exception();
         }
     }
 
+    std::shared_ptr<base_factory_t>
+    rebind(application_t *a) const {
+        method_factory_t *factory = new method_factory_t(*this);
+        factory->set_application(dynamic_cast<application_type*>(a));
+        factory->m_pool.reset();
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
 protected:
     void
     set_application(application_type *a) {
         m_app = a;
+
+        // The method is bound once per application rather than per handler.
+        if (m_app) {
+            m_bound = std::bind(m_func, m_app, std::placeholders::_1, std::placeholders::_2);
+        } else {
+            m_bound = nullptr;
+        }
     }
 
 protected:
     method_type m_func;
     application_type *m_app;
+    function_handler_t::function_type m_bound;
+    size_t m_pool_capacity;
+    size_t m_spill_threshold;
+    std::shared_ptr<handler_pool_t<function_handler_t>> m_pool;
 };
 
 class function_factory_t :
     public base_factory_t
 {
 public:
-    function_factory_t(function_handler_t::function_type f) :
-        m_func(f)
+    // A non-zero pool capacity makes the factory recycle its handlers, see
+    // function_handler_t for the spill threshold.
+    function_factory_t(function_handler_t::function_type f,
+                       size_t pool_capacity = 0,
+                       size_t spill_threshold = 0) :
+        m_func(f),
+        m_pool_capacity(pool_capacity),
+        m_spill_threshold(spill_threshold)
     {
         // pass
     }
@@ -201,11 +726,249 @@ public:
     std::shared_ptr<base_handler_t>
     make_handler()
     {
-        return std::shared_ptr<base_handler_t>(new function_handler_t(m_func));
+        if (m_pool_capacity) {
+            if (!m_pool) {
+                m_pool = std::make_shared<handler_pool_t<function_handler_t>>(m_pool_capacity);
+            }
+
+            return m_pool->acquire(m_func, m_spill_threshold);
+        }
+
+        return std::shared_ptr<base_handler_t>(new function_handler_t(m_func, m_spill_threshold));
+    }
+
+    std::shared_ptr<base_factory_t>
+    rebind(application_t * /* a */) const {
+        function_factory_t *factory = new function_factory_t(*this);
+        factory->m_pool.reset();
+        return std::shared_ptr<base_factory_t>(factory);
     }
 
 private:
     function_handler_t::function_type m_func;
+    size_t m_pool_capacity;
+    size_t m_spill_threshold;
+    std::shared_ptr<handler_pool_t<function_handler_t>> m_pool;
+};
+
+// Incremental counterpart of function_handler_t. Every chunk is folded into
+// the per-session state as soon as it arrives, so nothing is buffered unless
+// the fold decides to, and the fold may start writing the response right
+// away. At the end of the request the state is finalized into the last
+// chunk of the response, which is then closed.
+template<class StateT>
+class streaming_handler_t :
+    public base_handler_t
+{
+public:
+    typedef std::function<void(StateT&, const char*, size_t, response_stream_t&)>
+            fold_type;
+    typedef std::function<std::string(StateT&, const std::string&)>
+            finalize_type;
+
+public:
+    streaming_handler_t(fold_type fold,
+                        finalize_type finalize) :
+        m_fold(fold),
+        m_finalize(finalize)
+    {
+        // pass
+    }
+
+    void
+    invoke(const std::string& event,
+           std::shared_ptr<response_stream_t> response)
+    {
+        m_response = response;
+        m_event = event;
+    }
+
+    void
+    write(const char *chunk,
+         size_t size)
+    {
+        m_fold(m_state, chunk, size, *m_response);
+    }
+
+    void
+    close() {
+        std::string result = m_finalize(m_state, m_event);
+
+        if (!result.empty()) {
+            m_response->write(result.data(), result.size());
+        }
+
+        m_response->close();
+    }
+
+    void
+    error(cocaine::error_code code,
+          const std::string& message)
+    {
+        // pass
+    }
+
+    void
+    reset() {
+        m_state = StateT();
+        m_event.clear();
+        m_response.reset();
+    }
+
+private:
+    fold_type m_fold;
+    finalize_type m_finalize;
+
+    StateT m_state;
+    std::string m_event;
+    std::shared_ptr<response_stream_t> m_response;
+};
+
+template<class StateT>
+class streaming_function_factory_t :
+    public base_factory_t
+{
+    typedef streaming_handler_t<StateT> handler_type;
+
+public:
+    // A non-zero pool capacity makes the factory recycle its handlers.
+    streaming_function_factory_t(typename handler_type::fold_type fold,
+                                 typename handler_type::finalize_type finalize,
+                                 size_t pool_capacity = 0) :
+        m_fold(fold),
+        m_finalize(finalize),
+        m_pool_capacity(pool_capacity)
+    {
+        // pass
+    }
+
+    std::shared_ptr<base_handler_t>
+    make_handler()
+    {
+        if (m_pool_capacity) {
+            if (!m_pool) {
+                m_pool = std::make_shared<handler_pool_t<handler_type>>(m_pool_capacity);
+            }
+
+            return m_pool->acquire(m_fold, m_finalize);
+        }
+
+        return std::shared_ptr<base_handler_t>(new handler_type(m_fold, m_finalize));
+    }
+
+    std::shared_ptr<base_factory_t>
+    rebind(application_t * /* a */) const {
+        streaming_function_factory_t *factory = new streaming_function_factory_t(*this);
+        factory->m_pool.reset();
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
+private:
+    typename handler_type::fold_type m_fold;
+    typename handler_type::finalize_type m_finalize;
+    size_t m_pool_capacity;
+    std::shared_ptr<handler_pool_t<handler_type>> m_pool;
+};
+
+// Binds the fold and finalize methods to the application. Register it from
+// the application constructor with on("event",
+// streaming_method_factory_t<AppT, StateT>(&AppT::fold, &AppT::finalize)).
+// A fold which doesn't write the response may leave the stream out.
+template<class AppT, class StateT>
+class streaming_method_factory_t :
+    public base_factory_t
+{
+    friend class application_t;
+
+    typedef streaming_handler_t<StateT> handler_type;
+
+    typedef AppT application_type;
+    typedef std::function<void(AppT*, StateT&, const char*, size_t, response_stream_t&)>
+            fold_method_type;
+    typedef std::function<std::string(AppT*, StateT&, const std::string&)>
+            finalize_method_type;
+
+public:
+    // A non-zero pool capacity makes the factory recycle its handlers.
+    streaming_method_factory_t(fold_method_type fold,
+                               finalize_method_type finalize,
+                               size_t pool_capacity = 0) :
+        m_fold(fold),
+        m_finalize(finalize),
+        m_app(nullptr),
+        m_pool_capacity(pool_capacity)
+    {
+        // pass
+    }
+
+    streaming_method_factory_t(void (AppT::*fold)(StateT&, const char*, size_t),
+                               finalize_method_type finalize,
+                               size_t pool_capacity = 0) :
+        m_fold(std::bind(fold,
+                         std::placeholders::_1,
+                         std::placeholders::_2,
+                         std::placeholders::_3,
+                         std::placeholders::_4)),
+        m_finalize(finalize),
+        m_app(nullptr),
+        m_pool_capacity(pool_capacity)
+    {
+        // pass
+    }
+
+    std::shared_ptr<base_handler_t>
+    make_handler()
+    {
+        if (m_app) {
+            if (m_pool_capacity) {
+                if (!m_pool) {
+                    m_pool = std::make_shared<handler_pool_t<handler_type>>(m_pool_capacity);
+                }
+
+                return m_pool->acquire(m_bound_fold, m_bound_finalize);
+            }
+
+            return std::shared_ptr<base_handler_t>(
+                new handler_type(m_bound_fold, m_bound_finalize)
+            );
+        } else {
+            throw bad_factory_exception();
+        }
+    }
+
+    std::shared_ptr<base_factory_t>
+    rebind(application_t *a) const {
+        streaming_method_factory_t *factory = new streaming_method_factory_t(*this);
+        factory->set_application(dynamic_cast<application_type*>(a));
+        factory->m_pool.reset();
+        return std::shared_ptr<base_factory_t>(factory);
+    }
+
+protected:
+    void
+    set_application(application_type *a) {
+        using namespace std::placeholders;
+
+        m_app = a;
+
+        // The methods are bound once per application rather than per handler.
+        if (m_app) {
+            m_bound_fold = std::bind(m_fold, m_app, _1, _2, _3, _4);
+            m_bound_finalize = std::bind(m_finalize, m_app, _1, _2);
+        } else {
+            m_bound_fold = nullptr;
+            m_bound_finalize = nullptr;
+        }
+    }
+
+protected:
+    fold_method_type m_fold;
+    finalize_method_type m_finalize;
+    application_type *m_app;
+    typename handler_type::fold_type m_bound_fold;
+    typename handler_type::finalize_type m_bound_finalize;
+    size_t m_pool_capacity;
+    std::shared_ptr<handler_pool_t<handler_type>> m_pool;
 };
 //
 //template<class MethodT, class ObjectT>
@@ -223,27 +986,59 @@ private:
 
 class worker_t;
 
+// Limits on the lifetime of a session, in seconds, zero disables either. The
+// idle one is the time the engine may take to send the next chunk or choke
+// after the previous one, the total one runs from the invocation.
+struct deadline_t {
+    double idle;
+    double total;
+};
+
 class application_t {
     friend class worker_t;
     typedef std::map<std::string, std::shared_ptr<base_factory_t>>
             handlers_map;
 public:
+    application_t() :
+        m_frozen(false),
+        m_pool(nullptr),
+        m_loop(nullptr),
+        m_metrics(nullptr)
+    {
+        // pass
+    }
+
     virtual
     ~application_t()
     {
         // pass
     }
 
+    // If given, 'stream' is set to the stream the session has to be failed
+    // through from the outside, which is the response itself unless the event
+    // is metered, so that the failure is accounted to the event as well.
     virtual
     std::shared_ptr<base_handler_t>
     invoke(const std::string& event,
-           std::shared_ptr<cocaine::api::stream_t> response);
+           std::shared_ptr<response_stream_t> response,
+           std::shared_ptr<response_stream_t> *stream = nullptr);
 
     const std::string&
     name() const {
         return m_name;
     }
 
+    // Null if the event has no deadlines. Only valid once the application
+    // has been initialized.
+    const deadline_t*
+    find_deadline(const std::string& event) const {
+        return m_deadline_table.find(event);
+    }
+
+    // Reserved event, answered with a JSON dump of the application's metrics
+    // when the application runs in a worker.
+    static const std::string metrics_event;
+
 protected:
     virtual
     void
@@ -255,6 +1050,26 @@ protected:
     on(const std::string& event,
        const FactoryT<HandlerT>& factory = FactoryT<HandlerT>());
 
+    // Typed events: the request is a single msgpack object converted to the
+    // Request type, the result is sent back msgpack encoded. Defined in
+    // typed_handler.hpp, which has to be included to use them.
+    template<class Request, class Response>
+    void
+    on(const std::string& event,
+       std::function<Response(const Request&)> function,
+       size_t pool_capacity = 0);
+
+    template<class Request, class Response, class AppT>
+    void
+    on(const std::string& event,
+       Response (AppT::*method)(const Request&),
+       size_t pool_capacity = 0);
+
+    template<class AppT, class StateT>
+    void
+    on(const std::string& event,
+       const streaming_method_factory_t<AppT, StateT>& factory);
+
     virtual
     void
     on_unregistered(std::shared_ptr<base_factory_t> factory);
@@ -263,16 +1078,100 @@ protected:
     void
     on_unregistered(const FactoryT<HandlerT>& factory = FactoryT<HandlerT>());
 
+    // Runs the handlers of this event on the worker's thread pool instead of
+    // the event loop. Calls for a single session are still serialized, and
+    // the socket I/O stays on the loop thread. Handlers of offloaded events
+    // must not touch application state without synchronization.
+    void
+    offload(const std::string& event);
+
+    // Once a deadline of a session of this event is missed, the handler gets
+    // an error(), the response is closed with a timeout error and the session
+    // is dropped, so whatever the engine sends for it afterwards is ignored.
+    void
+    deadline(const std::string& event,
+             double idle,
+             double total);
+
+    // Answers repeated requests of this event with the same input from a
+    // cache of up to the given number of bytes, the event's handler is only
+    // invoked on a miss. Responses older than a non-zero TTL, in seconds, are
+    // not used. Only fit for pure functions of the input which respond in
+    // close(), like function and method handlers. Every instance of the
+    // application has its own cache.
+    void
+    memoize(const std::string& event,
+            size_t capacity,
+            double ttl = 0);
+
     virtual
     void
     initialize(const std::string& name,
                std::shared_ptr<cocaine::logger::logger_t> logger);
 
+private:
+    // The worker runs its own copies of the application it has been given,
+    // this makes the factories of a copy create handlers bound to that copy.
+    void
+    rebind();
+
+    // Picks up the metrics of every registered event from m_metrics.
+    void
+    meter();
+
 private:
     std::string m_name;
     handlers_map m_handlers;
+
+    // Built from m_handlers by initialize(), invoke() only looks here after
+    // that point.
+    dispatch_table_t<base_factory_t> m_dispatch;
+    bool m_frozen;
+
     std::shared_ptr<base_factory_t> m_default_handler;
     std::shared_ptr<cocaine::logger::log_t> m_log;
+
+    // Events to be offloaded and the executors to do it with, the latter
+    // are set by the worker before the application is initialized.
+    std::set<std::string> m_offloaded;
+    executor_t *m_pool;
+    executor_t *m_loop;
+
+    std::map<std::string, std::shared_ptr<deadline_t>> m_deadlines;
+    dispatch_table_t<deadline_t> m_deadline_table;
+
+    // Capacity and TTL of the cache of every memoized event.
+    std::map<std::string, std::pair<size_t, double>> m_memoized;
+
+    // Shared by all the instances and set by the worker as well, invocations
+    // aren't metered without it. Events without a handler are accounted to
+    // the default handler's entry.
+    metrics_t *m_metrics;
+    metrics_t::event_map_t m_event_metrics;
+    dispatch_table_t<event_metrics_t> m_metered;
+    std::shared_ptr<event_metrics_t> m_default_metrics;
+};
+
+// Counters of the batched reactor mode, see worker_t::set_batch_limit().
+struct batch_stats_t {
+    batch_stats_t() :
+        batches(0),
+        messages(0),
+        max_messages(0),
+        flushes(0),
+        bytes(0)
+    {
+        // pass
+    }
+
+    // Batches dispatched, normally one per loop wakeup, and messages in them.
+    uint64_t batches;
+    uint64_t messages;
+    uint64_t max_messages;
+
+    // Non-empty flushes and bytes handed to the socket by them.
+    uint64_t flushes;
+    uint64_t bytes;
 };
 
 class worker_t :
@@ -281,13 +1180,36 @@ class worker_t :
     struct io_pair_t {
         std::shared_ptr<cocaine::api::stream_t> upstream;
         std::shared_ptr<cocaine::api::stream_t> downstream;
+
+        // Deadlines, in the reactor's timer wheel ticks. The timer is set to
+        // the earliest of the two.
+        timer_wheel_t<uint64_t>::handle_type timer;
+        uint64_t idle;
+        uint64_t expires;
+
+        // Shared with the upstream, see response_stream_t::cancelled().
+        std::shared_ptr<std::atomic<bool>> cancelled;
+
+        // Once the session has got the choke while its total deadline is still
+        // armed, both streams are dropped and only the response is watched.
+        std::weak_ptr<cocaine::api::stream_t> choked;
     };
 
-    typedef std::map<uint64_t, io_pair_t> stream_map_t;
+    typedef session_table_t<io_pair_t> stream_map_t;
+
+    // A chunk, or a choke if there is no data, held back by flow control.
+    struct held_t {
+        bool choke;
+        std::string data;
+    };
+
+    class reactor_t;
 
 public:
+    // The engine's socket defaults to /var/run/cocaine/engines/<name>.
     worker_t(const std::string& name,
-             const std::string& uuid);
+             const std::string& uuid,
+             const std::string& endpoint = std::string());
 
     ~worker_t();
 
@@ -302,16 +1224,159 @@ public:
     void
     send(Args&&... args);
 
+    void
+    send(uint64_t session_id,
+         const iovec *iov,
+         size_t count);
+
+    // See writer_t::begin_chunk().
+    chunk_writer_t&
+    begin_chunk(uint64_t session_id);
+
+    void
+    commit_chunk(uint64_t session_id);
+
+    void
+    abort_chunk(uint64_t session_id);
+
+    // In batched mode every message already received is dispatched before
+    // any output is flushed, and everything is flushed once right before the
+    // loop goes back to polling. The limit bounds the number of messages
+    // dispatched between two flushes; zero disables the mode, in which case
+    // output is flushed after every message.
+    void
+    set_batch_limit(size_t limit);
+
+    const batch_stats_t&
+    stats() const {
+        return m_stats;
+    }
+
+    // Outbound flow control. Once more than 'high' bytes are waiting for the
+    // engine to read them the channel is congested and the response streams
+    // report themselves as not writable, until the backlog is drained down
+    // to 'low' bytes. Zero disables flow control; defaults to 4MB and 1MB.
+    void
+    set_watermarks(size_t high,
+                   size_t low);
+
+    // May be called from any thread.
+    bool
+    congested() const {
+        return m_congested.load(std::memory_order_acquire);
+    }
+
+    // Runs the callback on the loop thread once the channel is not congested,
+    // right away if it isn't.
+    void
+    on_drain(std::function<void()> callback);
+
+    // While the channel is congested, the chunks of a session whose own
+    // response hasn't completely left yet are held back, along with its
+    // choke, and delivered once the channel is drained. Off by default.
+    void
+    set_pause_backlogged(bool pause) {
+        m_pause_backlogged = pause;
+    }
+
+    // Forgets the flow control state of a session whose response is over,
+    // and disarms its total deadline if it has one.
+    void
+    finish(uint64_t session_id,
+           bool deadline = false);
+
+    // Number of threads to run offloaded handlers with. Must be set before
+    // the application is added, defaults to the number of cores.
+    void
+    set_pool_size(size_t size) {
+        m_pool_size = size;
+    }
+
+    // Number of reactor threads to spread the sessions over, each owning its
+    // own copy of the application, handlers and session table. The engine
+    // channel is still served by the main loop. Must be set before the
+    // application is added; zero, the default, runs everything on the main
+    // loop.
+    void
+    set_reactor_count(size_t count) {
+        m_reactor_count = count;
+    }
+
+    // Seconds between metrics dumps to the log, zero disables them. Must be
+    // set before the application is added, defaults to a minute.
+    void
+    set_metrics_interval(double interval) {
+        m_metrics_interval = interval;
+    }
+
+    const metrics_t&
+    metrics() const {
+        return m_metrics;
+    }
+
 private:
+    void
+    attach(const std::string& name,
+           const std::vector<std::shared_ptr<application_t>>& instances);
+
+    reactor_t&
+    route(uint64_t session_id);
+
     void
     on_message(const cocaine::io::message_t& message);
 
+    void
+    dispatch(const cocaine::io::message_t& message);
+
+    // Hand inbound messages to the session's reactor.
+    void
+    deliver(uint64_t session_id,
+            const char *chunk,
+            size_t size);
+
+    void
+    deliver(uint64_t session_id);
+
+    // Returns true if the message has been held back, see set_pause_backlogged().
+    bool
+    hold(uint64_t session_id,
+         const char *chunk,
+         size_t size);
+
+    bool
+    hold(uint64_t session_id);
+
+    // Remembers the writer position of the session's last chunk.
+    void
+    mark(uint64_t session_id);
+
+    // The engine has given up on the session.
+    void
+    cancel(uint64_t session_id,
+           int code,
+           const std::string& reason);
+
+    void
+    on_watermark(bool congested);
+
+    void
+    on_drained();
+
+    void
+    on_flush(ev::prepare&, int);
+
+    void
+    flush();
+
     void
     on_heartbeat(ev::timer&, int);
 
     void
     on_disown(ev::timer&, int);
 
+    void
+    on_metrics(ev::timer&, int);
+
     void
     terminate(int code,
               const std::string& reason);
@@ -321,31 +1386,70 @@ private:
     cocaine::io::service_t m_service;
     ev::timer m_heartbeat_timer,
               m_disown_timer;
+
+    // The one logging service connection, shared by the worker and the apps.
+    std::shared_ptr<cocaine::logger::remote_t> m_logger;
     std::shared_ptr<cocaine::logger::log_t> m_log;
-    std::shared_ptr<cocaine::io::channel<cocaine::io::socket<cocaine::io::local>>> m_channel;
+    std::shared_ptr<cocaine::io::decoder<cocaine::io::readable_stream<cocaine::io::socket<cocaine::io::local>>>> m_decoder;
+    std::unique_ptr<writer_t> m_writer;
+
+    // Batched reactor mode.
+    ev::prepare m_flush_watcher;
+    size_t m_batch_limit;
+    size_t m_batch;
+    batch_stats_t m_stats;
+
+    // Flow control, all but the flag are only touched on the loop thread.
+    // The marks are the writer positions of the sessions' last chunks.
+    std::atomic<bool> m_congested;
+    std::vector<std::function<void()>> m_drain_callbacks;
+    bool m_pause_backlogged;
+    session_table_t<uint64_t> m_marks;
+    session_table_t<std::deque<held_t>> m_held;
+    std::vector<uint64_t> m_held_sessions;
+
+    // NOTE: Sessions may outlive the reactors, so the metrics and the session
+    // arenas of every reactor must outlive both the reactors and the pool.
+    metrics_t m_metrics;
+    std::vector<std::unique_ptr<arena_pool_t>> m_arenas;
+    ev::timer m_metrics_timer;
+    double m_metrics_interval;
+
+    // Offloaded handlers and reactor threads get back to the main loop
+    // through the loop executor.
+    std::unique_ptr<loop_executor_t> m_loop_executor;
+
+    // NOTE: The reactors must outlive the pool, which may still post tasks
+    // to them while being stopped.
+    std::vector<std::unique_ptr<reactor_t>> m_reactors;
+    size_t m_reactor_count;
 
     std::string m_app_name;
     std::shared_ptr<application_t> m_application;
 
-    stream_map_t m_streams;
+    // NOTE: Declared last, so that the pool is stopped before anything its
+    // handlers may still be using goes away, the application first of all.
+    std::unique_ptr<thread_pool_t> m_pool;
+    size_t m_pool_size;
 };
 
 template<class Event, typename... Args>
 void
 worker_t::send(Args&&... args) {
-    m_channel->wr->write<Event>(std::forward<Args>(args)...);
+    m_writer->write<Event>(std::forward<Args>(args)...);
 }
 
 template<class AppT>
 void
 worker_t::add(const std::string& name, const AppT& a) {
     if (name == m_app_name) {
-        m_application.reset(new AppT(a));
+        std::vector<std::shared_ptr<application_t>> instances;
 
-        auto logger = std::shared_ptr<cocaine::logger::logger_t>(
-            new cocaine::logger::remote_t("remote", Json::Value(), m_service));
-        m_application->initialize(name, logger);
+        for (size_t i = 0; i < std::max<size_t>(m_reactor_count, 1); ++i) {
+            instances.push_back(std::make_shared<AppT>(a));
+        }
 
+        attach(name, instances);
     }
 }
 
@@ -359,6 +1463,16 @@ application_t::on(const std::string& event,
     this->on(event, std::shared_ptr<base_factory_t>(new_factory));
 }
 
+template<class AppT, class StateT>
+void
+application_t::on(const std::string& event,
+                  const streaming_method_factory_t<AppT, StateT>& factory)
+{
+    streaming_method_factory_t<AppT, StateT> *new_factory = new streaming_method_factory_t<AppT, StateT>(factory);
+    new_factory->set_application(dynamic_cast<AppT*>(this));
+    this->on(event, std::shared_ptr<base_factory_t>(new_factory));
+}
+
 template<class HandlerT, template<class> class FactoryT>
 void
 application_t::on_unregistered(const FactoryT<HandlerT>& factory) {
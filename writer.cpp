@@ -0,0 +1,261 @@
+#include "writer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+
+using namespace cocaine;
+
+writer_t::writer_t(io::service_t& service,
+                   std::shared_ptr<socket_type> socket):
+    m_socket(socket),
+    m_watcher(service.loop()),
+    m_offset(0),
+    m_sent(0),
+    m_chunk(&m_scratch),
+    m_chunk_session(0),
+    m_chunk_start(0),
+    m_chunk_header(0),
+    m_chunk_open(false),
+    m_corked(0),
+    m_high(0),
+    m_low(0),
+    m_congested(false)
+{
+    m_watcher.set<writer_t, &writer_t::on_event>(this);
+}
+
+writer_t::~writer_t() {
+    m_watcher.stop();
+}
+
+void
+writer_t::bind(error_handler_type handler) {
+    m_handler = handler;
+}
+
+void
+writer_t::bind_watermark(watermark_handler_type handler) {
+    m_watermark_handler = handler;
+}
+
+void
+writer_t::set_watermarks(size_t high,
+                         size_t low)
+{
+    m_high = high;
+    m_low = std::min(low, high);
+
+    check_watermarks();
+}
+
+void
+writer_t::write(uint64_t session_id,
+                const iovec *iov,
+                size_t count)
+{
+    size_t size = 0;
+
+    for(size_t i = 0; i < count; ++i) {
+        size += iov[i].iov_len;
+    }
+
+    drop_chunk();
+
+    msgpack::packer<buffer_t> packer(m_buffer);
+
+    packer.pack_array(2);
+    packer.pack(static_cast<int>(io::event_traits<io::rpc::chunk>::id));
+    packer.pack_array(2);
+    packer.pack(session_id);
+    packer.pack_raw(size);
+
+    for(size_t i = 0; i < count; ++i) {
+        packer.pack_raw_body(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+
+    check_watermarks();
+
+    if(!m_corked) {
+        flush();
+    }
+}
+
+chunk_writer_t&
+writer_t::begin_chunk(uint64_t session_id) {
+    drop_chunk();
+
+    m_chunk_session = session_id;
+    m_chunk_start = m_buffer.bytes.size();
+
+    msgpack::packer<buffer_t> packer(m_buffer);
+
+    packer.pack_array(2);
+    packer.pack(static_cast<int>(io::event_traits<io::rpc::chunk>::id));
+    packer.pack_array(2);
+    packer.pack(session_id);
+
+    // NOTE: The size isn't known yet, so it always takes the raw 32 form,
+    // which any decoder accepts for small sizes just as well.
+    m_chunk_header = m_buffer.bytes.size();
+    m_buffer.bytes.resize(m_chunk_header + 5);
+
+    m_chunk = chunk_writer_t(&m_buffer.bytes);
+    m_chunk_open = true;
+
+    return m_chunk;
+}
+
+size_t
+writer_t::commit_chunk(uint64_t session_id) {
+    if(!m_chunk_open || m_chunk_session != session_id) {
+        throw cocaine::error_t("the chunk has been aborted");
+    }
+
+    const size_t size = m_chunk.size();
+    const uint32_t length = static_cast<uint32_t>(size);
+
+    char *header = m_buffer.bytes.data() + m_chunk_header;
+
+    header[0] = static_cast<char>(0xdb);
+    header[1] = static_cast<char>(length >> 24);
+    header[2] = static_cast<char>(length >> 16);
+    header[3] = static_cast<char>(length >> 8);
+    header[4] = static_cast<char>(length);
+
+    reset_chunk();
+
+    check_watermarks();
+
+    if(!m_corked) {
+        flush();
+    }
+
+    return size;
+}
+
+void
+writer_t::abort_chunk(uint64_t session_id) {
+    if(!m_chunk_open || m_chunk_session != session_id) {
+        return;
+    }
+
+    drop_chunk();
+
+    // NOTE: Whatever was held back by the chunk can go now.
+    if(!m_corked) {
+        flush();
+    }
+}
+
+void
+writer_t::cork() {
+    ++m_corked;
+}
+
+void
+writer_t::uncork() {
+    if(--m_corked == 0) {
+        flush();
+    }
+}
+
+void
+writer_t::flush() {
+    // NOTE: If the socket is already congested, just wait for the watcher.
+    if(m_watcher.is_active() || m_chunk_open || pending() == 0) {
+        return;
+    }
+
+    while(pending()) {
+        ssize_t sent = ::send(
+            m_socket->fd(),
+            m_buffer.bytes.data() + m_offset,
+            pending(),
+            MSG_NOSIGNAL
+        );
+
+        if(sent == -1) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                m_watcher.start(m_socket->fd(), ev::WRITE);
+                break;
+            }
+
+            const std::error_code ec(errno, std::system_category());
+
+            m_buffer.bytes.clear();
+            m_offset = 0;
+
+            check_watermarks();
+
+            if(m_handler) {
+                m_handler(ec);
+            }
+
+            return;
+        }
+
+        m_offset += sent;
+        m_sent += sent;
+    }
+
+    if(pending() == 0) {
+        m_buffer.bytes.clear();
+        m_offset = 0;
+    } else if(m_offset > m_buffer.bytes.size() / 2) {
+        // Don't let the already sent part of the buffer grow without bound
+        // while the socket stays congested.
+        m_buffer.bytes.erase(m_buffer.bytes.begin(), m_buffer.bytes.begin() + m_offset);
+        m_offset = 0;
+    }
+
+    check_watermarks();
+}
+
+void
+writer_t::drop_chunk() {
+    if(!m_chunk_open) {
+        return;
+    }
+
+    m_buffer.bytes.resize(m_chunk_start);
+
+    reset_chunk();
+}
+
+void
+writer_t::reset_chunk() {
+    m_scratch.clear();
+
+    m_chunk = chunk_writer_t(&m_scratch);
+    m_chunk_open = false;
+}
+
+void
+writer_t::check_watermarks() {
+    bool congested = m_congested;
+
+    if(m_high == 0) {
+        congested = false;
+    } else if(!m_congested && pending() > m_high) {
+        congested = true;
+    } else if(m_congested && pending() <= m_low) {
+        congested = false;
+    }
+
+    if(congested != m_congested) {
+        m_congested = congested;
+
+        if(m_watermark_handler) {
+            m_watermark_handler(congested);
+        }
+    }
+}
+
+void
+writer_t::on_event(ev::io&, int) {
+    m_watcher.stop();
+    flush();
+}
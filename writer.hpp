@@ -0,0 +1,260 @@
+#ifndef COCAINE_GRAPE_WRITER
+#define COCAINE_GRAPE_WRITER
+
+#include <functional>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <sys/uio.h>
+#include <boost/utility.hpp>
+#include <cocaine/common.hpp>
+#include <cocaine/asio/local.hpp>
+#include <cocaine/asio/service.hpp>
+#include <cocaine/asio/socket.hpp>
+#include <cocaine/messages.hpp>
+#include <cocaine/traits/tuple.hpp>
+
+// Appends to a buffer in place, either with write(), which makes it usable
+// as a msgpack::packer stream, or by reserving space, filling it in and then
+// committing the part actually used.
+class chunk_writer_t {
+public:
+    chunk_writer_t(std::vector<char> *bytes = nullptr) :
+        m_bytes(bytes),
+        m_start(bytes ? bytes->size() : 0),
+        m_reserved(0)
+    {
+        // pass
+    }
+
+    // The space stays valid until the next call.
+    char*
+    reserve(size_t size) {
+        m_reserved = m_bytes->size();
+        m_bytes->resize(m_reserved + size);
+        return m_bytes->data() + m_reserved;
+    }
+
+    void
+    commit(size_t size) {
+        m_bytes->resize(m_reserved + size);
+    }
+
+    void
+    write(const char *data,
+          size_t size)
+    {
+        m_bytes->insert(m_bytes->end(), data, data + size);
+    }
+
+    // Bytes written so far.
+    size_t
+    size() const {
+        return m_bytes->size() - m_start;
+    }
+
+    const char*
+    data() const {
+        return m_bytes->data() + m_start;
+    }
+
+private:
+    std::vector<char> *m_bytes;
+    size_t m_start;
+    size_t m_reserved;
+};
+
+// Outbound half of the engine channel. Messages are encoded straight into a
+// single contiguous buffer. While the writer is corked nothing is sent, so
+// everything produced in the meantime leaves with one system call on uncork.
+class writer_t :
+    public boost::noncopyable
+{
+    struct buffer_t {
+        void
+        write(const char *data,
+              size_t size)
+        {
+            bytes.insert(bytes.end(), data, data + size);
+        }
+
+        std::vector<char> bytes;
+    };
+
+public:
+    typedef std::function<void(const std::error_code&)> error_handler_type;
+
+    // Called with true once the backlog grows past the high-water mark and
+    // with false once it has been drained down to the low-water mark.
+    typedef std::function<void(bool)> watermark_handler_type;
+
+    typedef cocaine::io::socket<cocaine::io::local> socket_type;
+
+public:
+    writer_t(cocaine::io::service_t& service,
+             std::shared_ptr<socket_type> socket);
+
+    ~writer_t();
+
+    void
+    bind(error_handler_type handler);
+
+    void
+    bind_watermark(watermark_handler_type handler);
+
+    // A zero high-water mark, the default, disables the notifications.
+    void
+    set_watermarks(size_t high,
+                   size_t low);
+
+    template<class Event, typename... Args>
+    void
+    write(Args&&... args);
+
+    // Encodes a single rpc::chunk message for the session, its payload being
+    // gathered from all the segments.
+    void
+    write(uint64_t session_id,
+          const iovec *iov,
+          size_t count);
+
+    // Starts an rpc::chunk message for the session whose payload is then
+    // encoded by the caller straight into the output buffer. The payload size
+    // is patched into the message header once the chunk is committed. Any
+    // other message or chunk started in between aborts the chunk, which then
+    // fails to commit, and the writes made through it afterwards are ignored.
+    chunk_writer_t&
+    begin_chunk(uint64_t session_id);
+
+    // Returns the size of the payload.
+    size_t
+    commit_chunk(uint64_t session_id);
+
+    // Drops the session's open chunk along with its message header, if it
+    // still has one.
+    void
+    abort_chunk(uint64_t session_id);
+
+    // Corking nests, the buffer is flushed when the outermost cork is popped.
+    void
+    cork();
+
+    void
+    uncork();
+
+    // Number of encoded bytes not yet accepted by the socket.
+    size_t
+    pending() const {
+        return m_buffer.bytes.size() - m_offset;
+    }
+
+    bool
+    congested() const {
+        return m_congested;
+    }
+
+    // Total number of bytes encoded and accepted by the socket respectively
+    // since the writer has been created. Everything encoded up to a given
+    // position has left once sent() reaches it.
+    uint64_t
+    position() const {
+        return m_sent + pending();
+    }
+
+    uint64_t
+    sent() const {
+        return m_sent;
+    }
+
+private:
+    void
+    flush();
+
+    void
+    drop_chunk();
+
+    void
+    reset_chunk();
+
+    void
+    check_watermarks();
+
+    void
+    on_event(ev::io&, int);
+
+private:
+    std::shared_ptr<socket_type> m_socket;
+    ev::io m_watcher;
+    error_handler_type m_handler;
+
+    buffer_t m_buffer;
+
+    // Offset of the first byte in the buffer which hasn't been sent yet.
+    size_t m_offset;
+    uint64_t m_sent;
+
+    // The chunk being encoded in place, the offsets of its message and of its
+    // size field. The buffer is neither flushed nor compacted until the chunk
+    // is committed or aborted.
+    //
+    // NOTE: A handler may still hold the chunk writer once the chunk is over,
+    // so it is then pointed at the scratch buffer, where whatever the handler
+    // keeps writing goes to waste until it fails to commit.
+    std::vector<char> m_scratch;
+    chunk_writer_t m_chunk;
+    uint64_t m_chunk_session;
+    size_t m_chunk_start;
+    size_t m_chunk_header;
+    bool m_chunk_open;
+
+    int m_corked;
+
+    // Flow control.
+    watermark_handler_type m_watermark_handler;
+    size_t m_high;
+    size_t m_low;
+    bool m_congested;
+};
+
+template<class Event, typename... Args>
+void
+writer_t::write(Args&&... args) {
+    drop_chunk();
+
+    msgpack::packer<buffer_t> packer(m_buffer);
+
+    packer.pack_array(2);
+
+    packer.pack(static_cast<int>(cocaine::io::event_traits<Event>::id));
+    cocaine::io::type_traits<typename cocaine::io::event_traits<Event>::tuple_type>::pack(
+        packer,
+        std::forward<Args>(args)...
+    );
+
+    check_watermarks();
+
+    if(!m_corked) {
+        flush();
+    }
+}
+
+// Keeps the writer corked for the lifetime of the guard.
+class scoped_cork_t :
+    public boost::noncopyable
+{
+public:
+    scoped_cork_t(writer_t& writer) :
+        m_writer(writer)
+    {
+        m_writer.cork();
+    }
+
+    ~scoped_cork_t() {
+        m_writer.uncork();
+    }
+
+private:
+    writer_t& m_writer;
+};
+
+#endif // COCAINE_GRAPE_WRITER